@@ -0,0 +1,171 @@
+#ifndef __ARQSIMUALLOC_HPP__
+#define __ARQSIMUALLOC_HPP__
+
+#include "arqsimucache.hpp"
+
+// sites that aren't heap allocations; heap sites come after these
+#define ARQSIMUALLOC_STACK 0
+#define ARQSIMUALLOC_GLOBALS 1
+#define ARQSIMUALLOC_UNKNOWN 2
+#define ARQSIMUALLOC_FIRST_HEAP 3
+
+// most cache levels whose misses are told apart
+#define ARQSIMUALLOC_MAX_LEVELS 2
+
+// Which allocation site each address belongs to, and how many misses each
+// site had in each cache level. A heap allocation's site is the
+// instruction that called the allocator; stacks and global data are sites
+// of their own.
+//
+// Live heap blocks are kept ordered by start address, so an address is
+// found in O(log n); the last block found is checked first, since misses
+// tend to come in runs over the same data structure. Allocations and frees
+// are O(log n) too, which a sorted array wouldn't give.
+class AllocationSites : public MissObserver {
+    private:
+        struct block {
+            ADDRINT end;
+            UINT32 site;
+        };
+        struct range {
+            ADDRINT start, end;
+        };
+        struct site {
+            ADDRINT ip;
+            UINT64 allocations;
+            UINT64 misses[ARQSIMUALLOC_MAX_LEVELS];
+        };
+
+        std::map<ADDRINT, block> blocks;
+        ADDRINT last_start, last_end;
+        UINT32 last_site;
+        vector<range> globals, stacks;
+        // index in sites of each allocating instruction
+        AddrMap<UINT32> site_ids;
+        vector<site> sites;
+
+        UINT32 new_site(ADDRINT ip);
+        bool in_ranges(const vector<range> &ranges, ADDRINT addr);
+
+    public:
+        AllocationSites();
+
+        // a block of size bytes at start was allocated by the call at ip
+        VOID allocate(ADDRINT ip, ADDRINT start, UINT64 size);
+        VOID release(ADDRINT start);
+        VOID add_globals(ADDRINT start, ADDRINT end);
+        VOID add_stack(ADDRINT start, ADDRINT end);
+
+        UINT32 find_site(ADDRINT addr);
+        virtual VOID miss(UINT32 level, VOID *ip, VOID *addr, bool is_write);
+
+        UINT32 get_sites();
+        // the allocating instruction of a heap site, 0 for the others
+        ADDRINT get_ip(UINT32 site_id);
+        UINT64 get_allocations(UINT32 site_id);
+        UINT64 get_misses(UINT32 site_id, UINT32 level);
+};
+
+
+//AllocationSites methods
+AllocationSites::AllocationSites() : last_start(0), last_end(0),
+    last_site(ARQSIMUALLOC_UNKNOWN), site_ids(1024) {
+    for (UINT32 i = 0; i < ARQSIMUALLOC_FIRST_HEAP; i++)
+        new_site(0);
+}
+
+UINT32 AllocationSites::new_site(ADDRINT ip) {
+    site s;
+    s.ip = ip;
+    s.allocations = 0;
+    for (UINT32 level = 0; level < ARQSIMUALLOC_MAX_LEVELS; level++)
+        s.misses[level] = 0;
+    sites.push_back(s);
+    return sites.size() - 1;
+}
+
+VOID AllocationSites::allocate(ADDRINT ip, ADDRINT start, UINT64 size) {
+    if (!start)
+        return;
+
+    UINT32 *id = site_ids.get(ip);
+    if (!*id)
+        *id = new_site(ip);
+    sites[*id].allocations++;
+
+    block b;
+    b.end = start + (size ? size : 1);
+    b.site = *id;
+    blocks[start] = b;
+}
+
+VOID AllocationSites::release(ADDRINT start) {
+    blocks.erase(start);
+    if (start == last_start)
+        last_start = last_end = 0;
+}
+
+VOID AllocationSites::add_globals(ADDRINT start, ADDRINT end) {
+    range r = {start, end};
+    globals.push_back(r);
+}
+
+VOID AllocationSites::add_stack(ADDRINT start, ADDRINT end) {
+    range r = {start, end};
+    stacks.push_back(r);
+}
+
+bool AllocationSites::in_ranges(const vector<range> &ranges, ADDRINT addr) {
+    for (UINT32 i = 0; i < ranges.size(); i++) {
+        if (addr >= ranges[i].start && addr < ranges[i].end)
+            return true;
+    }
+    return false;
+}
+
+UINT32 AllocationSites::find_site(ADDRINT addr) {
+    if (addr >= last_start && addr < last_end)
+        return last_site;
+
+    // the block starting at or right before addr
+    std::map<ADDRINT, block>::iterator it = blocks.upper_bound(addr);
+    if (it != blocks.begin()) {
+        it--;
+        if (addr < it->second.end) {
+            last_start = it->first;
+            last_end = it->second.end;
+            last_site = it->second.site;
+            return last_site;
+        }
+    }
+
+    if (in_ranges(stacks, addr))
+        return ARQSIMUALLOC_STACK;
+    if (in_ranges(globals, addr))
+        return ARQSIMUALLOC_GLOBALS;
+    return ARQSIMUALLOC_UNKNOWN;
+}
+
+VOID AllocationSites::miss(UINT32 level, VOID *ip, VOID *addr,
+    bool is_write) {
+    if (level < ARQSIMUALLOC_MAX_LEVELS)
+        sites[find_site((ADDRINT)addr)].misses[level]++;
+}
+
+UINT32 AllocationSites::get_sites() {
+    return sites.size();
+}
+
+ADDRINT AllocationSites::get_ip(UINT32 site_id) {
+    return sites[site_id].ip;
+}
+
+UINT64 AllocationSites::get_allocations(UINT32 site_id) {
+    return sites[site_id].allocations;
+}
+
+UINT64 AllocationSites::get_misses(UINT32 site_id, UINT32 level) {
+    return sites[site_id].misses[level];
+}
+
+#endif
@@ -1,39 +1,931 @@
-#include "arqsimucache.hpp"
+#include "arqsimuhierarchy.hpp"
+#include "arqsimustack.hpp"
+#include "arqsimuring.hpp"
+#include "arqsimupartition.hpp"
+#include "arqsimualloc.hpp"
+#include "arqsimupattern.hpp"
+#include "arqsimuvictim.hpp"
+#include "arqsimutlb.hpp"
+#include "arqsimudram.hpp"
+#include "arqsimucoherence.hpp"
+#include <string.h>
+#include <algorithm>
 
 
+static KNOB<UINT64> knob_l1_size(KNOB_MODE_WRITEONCE, "pintool", "l1_size",
+    "65536", "size of the L1 cache in bytes");
+static KNOB<UINT64> knob_l1_ways(KNOB_MODE_WRITEONCE, "pintool", "l1_ways",
+    "2", "associativity of the L1 cache");
+static KNOB<UINT64> knob_l1_line_len(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_line_len", "16", "line length of the L1 cache in bytes");
+static KNOB<UINT64> knob_l2_size(KNOB_MODE_WRITEONCE, "pintool", "l2_size",
+    "1024000", "size of the L2 cache in bytes");
+static KNOB<UINT64> knob_l2_ways(KNOB_MODE_WRITEONCE, "pintool", "l2_ways",
+    "2", "associativity of the L2 cache");
+static KNOB<UINT64> knob_l2_line_len(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_line_len", "16", "line length of the L2 cache in bytes");
+
+static KNOB<string> knob_l1_policy(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_policy", "fifo", "replacement policy of the L1 cache: fifo, lru, "
+    "plru (tree pseudo-LRU), srrip, brrip or random");
+static KNOB<string> knob_l2_policy(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_policy", "fifo", "replacement policy of the L2 cache, same choices "
+    "as l1_policy");
+
+static KNOB<string> knob_l2_inclusion(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_inclusion", "non_inclusive", "how L2 relates to L1: non_inclusive, "
+    "inclusive (L2 evictions invalidate L1 lines) or exclusive (L2 only "
+    "holds L1 victims, and hits move lines up)");
+
+static KNOB<string> knob_l1_write_policy(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_write_policy", "write_back", "write policy of the L1 cache: "
+    "write_back or write_through");
+static KNOB<string> knob_l2_write_policy(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_write_policy", "write_back", "write policy of the L2 cache, same "
+    "choices as l1_write_policy");
+static KNOB<bool> knob_l1_write_allocate(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_write_allocate", "1", "load the line on an L1 write miss");
+static KNOB<bool> knob_l2_write_allocate(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_write_allocate", "1", "load the line on an L2 write miss");
+static KNOB<UINT64> knob_l1_write_buffer(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_write_buffer", "0", "lines of the write buffer between L1 and L2, "
+    "which absorbs evictions and combines writes to the same line (0 for "
+    "none)");
+static KNOB<UINT64> knob_l2_write_buffer(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_write_buffer", "0", "lines of the write buffer between L2 and "
+    "memory (0 for none)");
+
+static KNOB<UINT64> knob_l1_mshrs(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_mshrs", "0", "L1 misses that can be in flight at once, without L1 "
+    "waiting for them (0 to wait for every miss)");
+static KNOB<UINT64> knob_l2_mshrs(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_mshrs", "0", "L2 misses that can be in flight at once (0 to wait "
+    "for every miss)");
+static KNOB<UINT64> knob_l1_request_interval(KNOB_MODE_WRITEONCE,
+    "pintool", "l1_request_interval", "1", "cycles between the requests L2 "
+    "takes from L1, with l1_mshrs");
+static KNOB<UINT64> knob_l2_request_interval(KNOB_MODE_WRITEONCE,
+    "pintool", "l2_request_interval", "1", "cycles between the requests "
+    "memory takes from L2, with l2_mshrs");
+static KNOB<UINT64> knob_l1_request_queue(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_request_queue", "8", "L1 requests that can wait for L2 to take "
+    "them, with l1_mshrs");
+static KNOB<UINT64> knob_l2_request_queue(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_request_queue", "8", "L2 requests that can wait for memory to take "
+    "them, with l2_mshrs");
+
+static KNOB<UINT64> knob_l1_victim_cache(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_victim_cache", "0", "lines of the fully associative victim cache "
+    "between L1 and L2 (0 for none)");
+static KNOB<UINT64> knob_l2_victim_cache(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_victim_cache", "0", "lines of the victim cache between L2 and "
+    "memory (0 for none)");
+static KNOB<string> knob_victim_cache_kind(KNOB_MODE_WRITEONCE, "pintool",
+    "victim_cache_kind", "victim", "what the victim caches keep: victim "
+    "(the lines the level above evicts) or miss (copies of the lines it "
+    "misses on)");
+
+static KNOB<string> knob_memory(KNOB_MODE_WRITEONCE, "pintool", "memory",
+    "ram", "main memory below L2: ram (every access takes the same time) or "
+    "dram (banks with row buffers)");
+static KNOB<UINT64> knob_dram_channels(KNOB_MODE_WRITEONCE, "pintool",
+    "dram_channels", "1", "DRAM channels (a power of 2, as are ranks, banks "
+    "and row_len)");
+static KNOB<UINT64> knob_dram_ranks(KNOB_MODE_WRITEONCE, "pintool",
+    "dram_ranks", "1", "DRAM ranks per channel");
+static KNOB<UINT64> knob_dram_banks(KNOB_MODE_WRITEONCE, "pintool",
+    "dram_banks", "8", "DRAM banks per rank");
+static KNOB<UINT64> knob_dram_row_len(KNOB_MODE_WRITEONCE, "pintool",
+    "dram_row_len", "8192", "bytes in a DRAM row, at least an L2 line");
+static KNOB<string> knob_dram_page_policy(KNOB_MODE_WRITEONCE, "pintool",
+    "dram_page_policy", "open", "open (rows stay open after an access) or "
+    "closed (rows are closed right away)");
+static KNOB<string> knob_dram_mapping(KNOB_MODE_WRITEONCE, "pintool",
+    "dram_mapping", "row:rank:bank:channel:column", "address bits of each "
+    "DRAM field, from the most significant, row first");
+static KNOB<UINT64> knob_dram_trcd(KNOB_MODE_WRITEONCE, "pintool",
+    "dram_trcd", "4", "cycles to open a DRAM row");
+static KNOB<UINT64> knob_dram_tcas(KNOB_MODE_WRITEONCE, "pintool",
+    "dram_tcas", "4", "cycles to access a column of an open DRAM row");
+static KNOB<UINT64> knob_dram_trp(KNOB_MODE_WRITEONCE, "pintool",
+    "dram_trp", "4", "cycles to close a DRAM row");
+
+static KNOB<bool> knob_tlb(KNOB_MODE_WRITEONCE, "pintool", "tlb", "0",
+    "translate addresses through data TLBs before the caches, and walk the "
+    "page tables through the caches on TLB misses");
+static KNOB<string> knob_page_size(KNOB_MODE_WRITEONCE, "pintool",
+    "page_size", "4k", "size of every page: 4k, 2m or 1g");
+static KNOB<UINT64> knob_dtlb_entries(KNOB_MODE_WRITEONCE, "pintool",
+    "dtlb_entries", "64", "entries of the L1 data TLB");
+static KNOB<UINT64> knob_dtlb_ways(KNOB_MODE_WRITEONCE, "pintool",
+    "dtlb_ways", "4", "associativity of the L1 data TLB (entries/ways a "
+    "power of 2)");
+static KNOB<UINT64> knob_stlb_entries(KNOB_MODE_WRITEONCE, "pintool",
+    "stlb_entries", "1536", "entries of the L2 TLB");
+static KNOB<UINT64> knob_stlb_ways(KNOB_MODE_WRITEONCE, "pintool",
+    "stlb_ways", "12", "associativity of the L2 TLB (entries/ways a power "
+    "of 2)");
+
+static KNOB<string> knob_l1_prefetcher(KNOB_MODE_WRITEONCE, "pintool",
+    "l1_prefetcher", "none", "prefetcher attached to the L1 cache: none, "
+    "next_line, stride (by instruction) or stream");
+static KNOB<string> knob_l2_prefetcher(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_prefetcher", "none", "prefetcher attached to the L2 cache, same "
+    "choices as l1_prefetcher");
+static KNOB<UINT64> knob_prefetch_degree(KNOB_MODE_WRITEONCE, "pintool",
+    "prefetch_degree", "1", "lines the prefetchers ask for at a time");
+
+static KNOB<UINT32> knob_top_misses(KNOB_MODE_WRITEONCE, "pintool",
+    "top_misses", "0", "report the instructions, functions and source "
+    "lines with the most L1 and L2 misses, this many of each");
+
+static KNOB<UINT32> knob_alloc_sites(KNOB_MODE_WRITEONCE, "pintool",
+    "alloc_sites", "0", "report the allocation sites (heap blocks by the "
+    "instruction that allocated them, stacks and global data) with the most "
+    "L1 and L2 misses, this many");
+
+static KNOB<UINT32> knob_utilization(KNOB_MODE_WRITEONCE, "pintool",
+    "utilization", "0", "report how much of the L1 and L2 lines was used "
+    "before they were evicted, and the instructions that loaded the lines "
+    "that wasted the most bytes, this many");
+
+static KNOB<UINT32> knob_access_patterns(KNOB_MODE_WRITEONCE, "pintool",
+    "access_patterns", "0", "report the reuse distances and dominant stride "
+    "of the instructions with the most accesses, this many");
+static KNOB<UINT64> knob_pattern_ips(KNOB_MODE_WRITEONCE, "pintool",
+    "pattern_ips", "65536", "instructions whose access patterns are kept "
+    "(at least); accesses of the rest are only counted");
+
+static KNOB<bool> knob_same_line_filter(KNOB_MODE_WRITEONCE, "pintool",
+    "same_line_filter", "1", "resolve repeated accesses to the last L1 line "
+    "inline, without calling into the hierarchy");
+
+static KNOB<bool> knob_buffer(KNOB_MODE_WRITEONCE, "pintool", "buffer", "0",
+    "collect memory references in trace buffers and simulate them in bulk "
+    "when a buffer fills up");
+static KNOB<UINT32> knob_buffer_pages(KNOB_MODE_WRITEONCE, "pintool",
+    "buffer_pages", "256", "size of each thread's trace buffer in pages");
+
+static KNOB<bool> knob_stack_distance(KNOB_MODE_WRITEONCE, "pintool",
+    "stack_distance", "0", "also compute the LRU miss ratio of every cache "
+    "in a grid of set counts and associativities, in the same pass");
+static KNOB<UINT64> knob_sd_min_sets(KNOB_MODE_WRITEONCE, "pintool",
+    "sd_min_sets", "1", "smallest set count in the miss ratio grid (a "
+    "power of 2)");
+static KNOB<UINT64> knob_sd_max_sets(KNOB_MODE_WRITEONCE, "pintool",
+    "sd_max_sets", "4096", "largest set count in the miss ratio grid (a "
+    "power of 2)");
+static KNOB<UINT64> knob_sd_max_ways(KNOB_MODE_WRITEONCE, "pintool",
+    "sd_max_ways", "16", "largest associativity in the miss ratio grid");
+
+static KNOB<string> knob_configs(KNOB_MODE_WRITEONCE, "pintool", "configs",
+    "", "simulate these hierarchies in parallel, one worker thread each, "
+    "instead of the one given by the l1_ and l2_ knobs; they are written as "
+    "size:ways:line_len,size:ways:line_len for L1 and L2 (with a power of 2 "
+    "of sets), separated by ';', and each level may add :policy");
+static KNOB<UINT32> knob_ring_slots(KNOB_MODE_WRITEONCE, "pintool",
+    "ring_slots", "64", "batches of references the workers can fall behind "
+    "(at least 1)");
+
+static KNOB<UINT32> knob_partition_workers(KNOB_MODE_WRITEONCE, "pintool",
+    "partition_workers", "0", "simulate the hierarchy given by the l1_ and "
+    "l2_ knobs with this many worker threads, each of them owning a part of "
+    "the sets of every level");
+
+static KNOB<UINT64> knob_sample_sets(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_sets", "1", "simulate only one of every n sets (a power of 2) "
+    "of each cache, dropping the references to the others inline, and "
+    "extrapolate the hit ratios with their confidence intervals");
+
+static KNOB<bool> knob_coherence(KNOB_MODE_WRITEONCE, "pintool",
+    "coherence", "0", "give every thread a private L1 (l1_ knobs) and keep "
+    "them coherent with MESI through a directory in the shared L2 (l2_ "
+    "knobs), reporting the coherence traffic of each thread");
+static KNOB<UINT32> knob_false_sharing(KNOB_MODE_WRITEONCE, "pintool",
+    "false_sharing", "0", "with coherence, tell true from false sharing in "
+    "the coherence misses, and report the lines with the most coherence "
+    "misses, this many, with the bytes each thread wrote, the instructions "
+    "involved and their allocation sites");
+
+// must be a power of 2: thread ids are masked into this range
+#define ARQSIMUCACHE_MAXTHREADS 256
+
+// stack of each thread below its initial stack pointer, and what's above
+// it (arguments and environment of the main thread)
+#define ARQSIMUCACHE_STACK_SIZE (8*1024*1024)
+#define ARQSIMUCACHE_STACK_TOP (64*1024)
+
+// Last L1 line each thread accessed through the hierarchy. While no other
+// thread has gone through the hierarchy, that line is still in L1 and is
+// the most recently used one, so repeating an access to it is a hit that
+// changes nothing but the counters. Entries are padded to a host cache
+// line so that threads don't share them.
+struct line_filter {
+    ADDRINT line;
+    // same line, but only if it's known to be dirty (a write to a clean line
+    // has to go through the hierarchy to mark it)
+    ADDRINT dirty_line;
+    UINT64 read_hits;
+    UINT64 write_hits;
+    // accesses that went through the hierarchy
+    UINT64 lookups;
+    UINT8 padding[24];
+};
+
 static std::ofstream outfile;
 static Memory *front_memory;
+// stack distance profile of the references that reach L1, if enabled
+static StackDistance *stack_distance;
+
+static line_filter filters[ARQSIMUCACHE_MAXTHREADS];
+static UINT32 last_filter;
+static UINT64 l1_offset_len;
+static bool use_filter;
+
+// with set sampling, the generic caches of the hierarchy and the address
+// bits that select the sampled sets (they're all zero in their addresses)
+static Cache *l1_cache, *l2_cache;
+static UINT64 sample_shift, sample_mask;
+
+static BUFFER_ID buffer_id;
+// wall time when the tool started, and time spent simulating full buffers
+static double start_time, simulation_time;
+
+// parallel simulation of several configurations: the buffers of every
+// thread are published in the ring, and each worker simulates one hierarchy
+static vector<hierarchy_config> configs;
+static vector<Memory *> config_memories;
+static vector<PIN_THREAD_UID> workers;
+static BatchRing *ring;
+// application threads take turns publishing
+static PIN_LOCK ring_lock;
+static UINT64 published;
+
+// allocation sites, if misses are attributed to them; allocations and
+// the hierarchy are only touched with alloc_lock held
+static AllocationSites *alloc_sites;
+static PIN_LOCK alloc_lock;
+
+// access patterns by instruction, if they're reported
+static AccessPatterns *access_patterns;
+
+// data TLBs in front of the hierarchy, if they're simulated
+static DataTLBs *tlbs;
+
+// private L1s over a coherent L2, if they're simulated; each thread keeps
+// its L1 in its thread data, under l1_key
+static CoherentHierarchy *coherent;
+static TLS_KEY l1_key;
+// true and false sharing in its coherence misses, if they're told apart
+static SharingDetector *sharing;
+
+// Allocator call a thread is in. Allocators may call each other (realloc
+// calling malloc and free, say), so only the outermost call counts.
+struct alloc_call {
+    UINT64 depth;
+    ADDRINT ip, size, old_block;
+    UINT8 padding[32];
+};
+static alloc_call alloc_calls[ARQSIMUCACHE_MAXTHREADS];
+
+// one hierarchy simulated by several workers, split by sets
+static PartitionedHierarchy *partitioned;
+static PIN_LOCK partition_lock;
+static bool partition_stopped;
 
-static VOID rec_memread(VOID *ip, VOID *addr) {
-    front_memory->read(addr);
+// accesses that end in another line than they start are never the same
+// line, they have to be split by the hierarchy
+static ADDRINT PIN_FAST_ANALYSIS_CALL is_new_line_read(THREADID tid,
+    ADDRINT addr, UINT32 size) {
+    line_filter *filter = &filters[tid & (ARQSIMUCACHE_MAXTHREADS - 1)];
+    ADDRINT same = ((addr >> l1_offset_len) == filter->line) &
+        (((addr + size - 1) >> l1_offset_len) == filter->line);
+    filter->read_hits += same;
+    return !same;
 }
 
-static VOID rec_memwrite(VOID * ip, VOID * addr) {
-    front_memory->write(addr);
+static ADDRINT PIN_FAST_ANALYSIS_CALL is_new_line_write(THREADID tid,
+    ADDRINT addr, UINT32 size) {
+    line_filter *filter = &filters[tid & (ARQSIMUCACHE_MAXTHREADS - 1)];
+    ADDRINT same = ((addr >> l1_offset_len) == filter->dirty_line) &
+        (((addr + size - 1) >> l1_offset_len) == filter->dirty_line);
+    filter->write_hits += same;
+    return !same;
+}
+
+// an access that spans lines in sampled and other sets goes through, and
+// the caches drop the lines of the other sets
+static ADDRINT PIN_FAST_ANALYSIS_CALL is_sampled(THREADID tid,
+    ADDRINT addr, UINT32 size) {
+    return !((addr >> sample_shift) & sample_mask) |
+        !(((addr + size - 1) >> sample_shift) & sample_mask);
+}
+
+// records the line a thread is about to access through the hierarchy, and
+// drops the line of the thread that did it before, which may not be in L1
+// anymore after this access
+static VOID update_filter(THREADID tid, VOID *addr, bool is_write) {
+    UINT32 current = tid & (ARQSIMUCACHE_MAXTHREADS - 1);
+    if (current != last_filter) {
+        filters[last_filter].line = ARQSIMUCACHE_NOTAG;
+        filters[last_filter].dirty_line = ARQSIMUCACHE_NOTAG;
+        last_filter = current;
+    }
+
+    filters[current].line = (ADDRINT)addr >> l1_offset_len;
+    filters[current].dirty_line = is_write ?
+        filters[current].line : ARQSIMUCACHE_NOTAG;
+    filters[current].lookups++;
+}
+
+// the stack distance profile sees every L1 line of an access, like L1 does
+static VOID profile_lines(VOID *addr, UINT32 size) {
+    ADDRINT line = (ADDRINT)addr >> l1_offset_len;
+    ADDRINT last = ((ADDRINT)addr + (size ? size : 1) - 1) >> l1_offset_len;
+    for (; line <= last; line++)
+        stack_distance->access(line << l1_offset_len);
+}
+
+static VOID rec_memread(THREADID tid, VOID *ip, VOID *addr, UINT32 size) {
+    if (coherent) {
+        coherent->read((PrivateCache *)PIN_GetThreadData(l1_key, tid), addr,
+            ip, size);
+        return;
+    }
+    if (alloc_sites)
+        PIN_GetLock(&alloc_lock, tid + 1);
+    update_filter(tid, addr, false);
+    if (tlbs)
+        tlbs->translate(addr, ip, size);
+    front_memory->read(addr, ip, size);
+    if (stack_distance)
+        profile_lines(addr, size);
+    if (access_patterns)
+        access_patterns->access(ip, addr);
+    if (alloc_sites)
+        PIN_ReleaseLock(&alloc_lock);
+}
+
+static VOID rec_memwrite(THREADID tid, VOID * ip, VOID * addr,
+    UINT32 size) {
+    if (coherent) {
+        coherent->write((PrivateCache *)PIN_GetThreadData(l1_key, tid), addr,
+            ip, size);
+        return;
+    }
+    if (alloc_sites)
+        PIN_GetLock(&alloc_lock, tid + 1);
+    update_filter(tid, addr, true);
+    if (tlbs)
+        tlbs->translate(addr, ip, size);
+    front_memory->write(addr, ip, size);
+    if (stack_distance)
+        profile_lines(addr, size);
+    if (access_patterns)
+        access_patterns->access(ip, addr);
+    if (alloc_sites)
+        PIN_ReleaseLock(&alloc_lock);
+}
+
+static VOID enter_allocator(THREADID tid, ADDRINT ip, ADDRINT size,
+    ADDRINT old_block) {
+    alloc_call *call = &alloc_calls[tid & (ARQSIMUCACHE_MAXTHREADS - 1)];
+    if (call->depth++)
+        return;
+
+    call->ip = ip;
+    call->size = size;
+    call->old_block = old_block;
+}
+
+static VOID before_malloc(THREADID tid, ADDRINT ip, ADDRINT size) {
+    enter_allocator(tid, ip, size, 0);
+}
+
+static VOID before_calloc(THREADID tid, ADDRINT ip, ADDRINT n,
+    ADDRINT size) {
+    enter_allocator(tid, ip, n*size, 0);
+}
+
+static VOID before_realloc(THREADID tid, ADDRINT ip, ADDRINT old_block,
+    ADDRINT size) {
+    enter_allocator(tid, ip, size, old_block);
+}
+
+static VOID after_allocator(THREADID tid, ADDRINT block) {
+    alloc_call *call = &alloc_calls[tid & (ARQSIMUCACHE_MAXTHREADS - 1)];
+    if (!call->depth || --call->depth)
+        return;
+
+    PIN_GetLock(&alloc_lock, tid + 1);
+    // a failed realloc leaves the old block alone
+    if (call->old_block && (block || !call->size))
+        alloc_sites->release(call->old_block);
+    alloc_sites->allocate(call->ip, block, call->size);
+    PIN_ReleaseLock(&alloc_lock);
+}
+
+static VOID before_free(THREADID tid, ADDRINT block) {
+    if (alloc_calls[tid & (ARQSIMUCACHE_MAXTHREADS - 1)].depth)
+        return;
+
+    PIN_GetLock(&alloc_lock, tid + 1);
+    alloc_sites->release(block);
+    PIN_ReleaseLock(&alloc_lock);
+}
+
+static VOID instrument_allocator(IMG img, const CHAR *name,
+    AFUNPTR before, UINT32 args) {
+    RTN rtn = RTN_FindByName(img, name);
+    if (!RTN_Valid(rtn))
+        return;
+
+    RTN_Open(rtn);
+    if (args == 1) {
+        RTN_InsertCall(rtn, IPOINT_BEFORE, before, IARG_THREAD_ID,
+            IARG_RETURN_IP, IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
+    } else {
+        RTN_InsertCall(rtn, IPOINT_BEFORE, before, IARG_THREAD_ID,
+            IARG_RETURN_IP, IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+            IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_END);
+    }
+    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)after_allocator,
+        IARG_THREAD_ID, IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
+    RTN_Close(rtn);
+}
+
+static VOID instrument_image(IMG img, VOID *v) {
+    instrument_allocator(img, "malloc", (AFUNPTR)before_malloc, 1);
+    instrument_allocator(img, "calloc", (AFUNPTR)before_calloc, 2);
+    instrument_allocator(img, "realloc", (AFUNPTR)before_realloc, 2);
+
+    RTN rtn = RTN_FindByName(img, "free");
+    if (RTN_Valid(rtn)) {
+        RTN_Open(rtn);
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)before_free,
+            IARG_THREAD_ID, IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
+        RTN_Close(rtn);
+    }
+
+    PIN_GetLock(&alloc_lock, 0);
+    for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
+        if (SEC_Mapped(sec) &&
+            (SEC_Type(sec) == SEC_TYPE_DATA || SEC_Type(sec) == SEC_TYPE_BSS))
+            alloc_sites->add_globals(SEC_Address(sec),
+                SEC_Address(sec) + SEC_Size(sec));
+    }
+    PIN_ReleaseLock(&alloc_lock);
+}
+
+static VOID start_thread(THREADID tid, CONTEXT *ctxt, INT32 flags,
+    VOID *v) {
+    ADDRINT sp = PIN_GetContextReg(ctxt, REG_STACK_PTR);
+
+    PIN_GetLock(&alloc_lock, tid + 1);
+    alloc_sites->add_stack(sp - ARQSIMUCACHE_STACK_SIZE,
+        sp + ARQSIMUCACHE_STACK_TOP);
+    PIN_ReleaseLock(&alloc_lock);
+}
+
+// the sharing detector looks up allocation sites while the target runs
+static UINT32 find_alloc_site(ADDRINT addr) {
+    PIN_GetLock(&alloc_lock, 0);
+    UINT32 site = alloc_sites->find_site(addr);
+    PIN_ReleaseLock(&alloc_lock);
+    return site;
+}
+
+static VOID start_core(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
+    PIN_SetThreadData(l1_key, coherent->add_thread(tid), tid);
+}
+
+// simulates a full trace buffer, applying the same filter as the inline
+// analysis routines
+static VOID *process_buffer(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt,
+    VOID *buf, UINT64 elements, VOID *v) {
+    double start = wall_time();
+
+    memref *refs = (memref *)buf;
+    for (UINT64 i = 0; i < elements; i++) {
+        VOID *ip = (VOID *)refs[i].ip, *addr = (VOID *)refs[i].addr;
+        UINT32 size = refs[i].size;
+        if (!is_sampled(tid, refs[i].addr, size))
+            continue;
+
+        if (refs[i].is_write) {
+            if (!use_filter || is_new_line_write(tid, refs[i].addr, size))
+                rec_memwrite(tid, ip, addr, size);
+        } else {
+            if (!use_filter || is_new_line_read(tid, refs[i].addr, size))
+                rec_memread(tid, ip, addr, size);
+        }
+    }
+
+    simulation_time += wall_time() - start;
+    return buf;
+}
+
+static VOID simulate_batch(Memory *memory, const memref *refs, UINT64 n) {
+    for (UINT64 i = 0; i < n; i++) {
+        if (refs[i].is_write)
+            memory->write((VOID *)refs[i].addr, (VOID *)refs[i].ip,
+                refs[i].size);
+        else
+            memory->read((VOID *)refs[i].addr, (VOID *)refs[i].ip,
+                refs[i].size);
+    }
+}
+
+static VOID run_worker(VOID *arg) {
+    UINT32 consumer = (UINT32)(ADDRINT)arg;
+
+    memref *batch;
+    UINT64 n;
+    while (ring->wait_batch(consumer, &batch, &n)) {
+        simulate_batch(config_memories[consumer], batch, n);
+        ring->release(consumer);
+    }
+}
+
+static VOID *publish_buffer(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt,
+    VOID *buf, UINT64 elements, VOID *v) {
+    memref *refs = (memref *)buf;
+
+    PIN_GetLock(&ring_lock, tid + 1);
+    if (ring->is_closed()) {
+        // the workers are gone (threads still exiting after the
+        // application did), having simulated every batch published, so
+        // whatever is left is simulated here
+        for (UINT32 i = 0; i < config_memories.size(); i++)
+            simulate_batch(config_memories[i], refs, elements);
+    } else {
+        for (UINT64 done = 0; done < elements; ) {
+            UINT64 n = elements - done;
+            if (n > ring->get_batch_len())
+                n = ring->get_batch_len();
+
+            memcpy(ring->next_slot(), refs + done, n*sizeof(memref));
+            ring->publish(n);
+            done += n;
+        }
+    }
+    published += elements;
+    PIN_ReleaseLock(&ring_lock);
+
+    return buf;
+}
+
+static VOID stop_workers(VOID *v) {
+    // workers finish every batch already published before exiting; the
+    // lock is held until they're gone, so that a buffer published in the
+    // meantime finds the ring closed only once its hierarchies are free
+    PIN_GetLock(&ring_lock, 0);
+    ring->close();
+    for (UINT32 i = 0; i < workers.size(); i++)
+        PIN_WaitForThreadTermination(workers[i], PIN_INFINITE_TIMEOUT, NULL);
+    PIN_ReleaseLock(&ring_lock);
+}
+
+static VOID run_partition_worker(VOID *arg) {
+    partitioned->run((UINT32)(ADDRINT)arg);
+}
+
+static VOID *partition_buffer(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt,
+    VOID *buf, UINT64 elements, VOID *v) {
+    PIN_GetLock(&partition_lock, tid + 1);
+    // once the workers are gone the caches hold their final state, and
+    // whatever is left is simulated here
+    if (partition_stopped)
+        simulate_batch(front_memory, (memref *)buf, elements);
+    else
+        partitioned->simulate((memref *)buf, elements);
+    published += elements;
+    PIN_ReleaseLock(&partition_lock);
+
+    return buf;
+}
+
+static VOID stop_partition_workers(VOID *v) {
+    PIN_GetLock(&partition_lock, 0);
+    partitioned->flush();
+    partitioned->stop();
+    partition_stopped = true;
+    PIN_ReleaseLock(&partition_lock);
+
+    for (UINT32 i = 0; i < workers.size(); i++)
+        PIN_WaitForThreadTermination(workers[i], PIN_INFINITE_TIMEOUT, NULL);
+}
+
+static VOID buffer_memop(INS ins, UINT32 memop, bool is_write) {
+    INS_InsertFillBufferPredicated(ins, IPOINT_BEFORE, buffer_id,
+        IARG_INST_PTR, offsetof(memref, ip),
+        IARG_MEMORYOP_EA, memop, offsetof(memref, addr),
+        IARG_UINT32, INS_MemoryOperandSize(ins, memop),
+        offsetof(memref, size),
+        IARG_UINT32, (UINT32)is_write, offsetof(memref, is_write),
+        IARG_END);
+}
+
+// calls the analysis routine of a memory operand, behind the inline check
+// that drops it, if there is one
+static VOID insert_memop(INS ins, UINT32 memop, bool is_write) {
+    AFUNPTR rec = is_write ? (AFUNPTR)rec_memwrite : (AFUNPTR)rec_memread;
+
+    AFUNPTR check = NULL;
+    if (use_filter)
+        check = is_write ? (AFUNPTR)is_new_line_write :
+            (AFUNPTR)is_new_line_read;
+    else if (sample_mask)
+        check = (AFUNPTR)is_sampled;
+
+    UINT32 size = INS_MemoryOperandSize(ins, memop);
+    if (!check) {
+        INS_InsertPredicatedCall(ins, IPOINT_BEFORE, rec, IARG_THREAD_ID,
+            IARG_INST_PTR, IARG_MEMORYOP_EA, memop, IARG_UINT32, size,
+            IARG_END);
+        return;
+    }
+
+    INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, check,
+        IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_MEMORYOP_EA, memop,
+        IARG_UINT32, size, IARG_END);
+    INS_InsertThenPredicatedCall(ins, IPOINT_BEFORE, rec, IARG_THREAD_ID,
+        IARG_INST_PTR, IARG_MEMORYOP_EA, memop, IARG_UINT32, size, IARG_END);
 }
 
 static VOID instrument_instruction(INS ins, VOID *v) {
     UINT32 memops = INS_MemoryOperandCount(ins);
 
     for (UINT32 memop = 0; memop < memops; memop++) {
-        if (INS_MemoryOperandIsRead(ins, memop)) {
-            INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)rec_memread,
-                IARG_INST_PTR, IARG_MEMORYOP_EA, memop, IARG_END);
+        if (knob_buffer || ring || partitioned) {
+            if (INS_MemoryOperandIsRead(ins, memop))
+                buffer_memop(ins, memop, false);
+            if (INS_MemoryOperandIsWritten(ins, memop))
+                buffer_memop(ins, memop, true);
+            continue;
         }
 
-        if (INS_MemoryOperandIsWritten(ins, memop)) {
-            INS_InsertPredicatedCall(ins, IPOINT_BEFORE,
-                (AFUNPTR)rec_memwrite, IARG_INST_PTR, IARG_MEMORYOP_EA, memop,
-                IARG_END);
-        }
+        if (INS_MemoryOperandIsRead(ins, memop))
+            insert_memop(ins, memop, false);
+        if (INS_MemoryOperandIsWritten(ins, memop))
+            insert_memop(ins, memop, true);
+    }
+}
+
+static VOID output_throughput(std::ostream *outstream, string mode,
+    UINT64 references) {
+    double elapsed = wall_time() - start_time;
+
+    *outstream << "=====" << std::endl;
+    *outstream << "throughput (" << mode << "):" << std::endl;
+    *outstream << "\treferences/wall time: " << uint_to_string(references) <<
+        " / " << double_to_string(elapsed) << " s = " <<
+        double_to_string(references/elapsed) << std::endl;
+
+    // in direct, parallel and partitioned modes simulation is interleaved
+    // with the target and can't be timed on its own
+    if (mode == "buffered") {
+        *outstream << "\treferences/simulation time: " <<
+            uint_to_string(references) << " / " <<
+            double_to_string(simulation_time) << " s = " <<
+            double_to_string(references/simulation_time) << std::endl;
     }
 }
 
+// misses of an instruction, function or source line
+struct miss_count {
+    string name;
+    UINT64 misses;
+};
+
+static bool more_misses(const miss_count &a, const miss_count &b) {
+    return a.misses > b.misses;
+}
+
+static VOID output_top_misses(std::ostream *outstream, string title,
+    vector<miss_count> *counts, UINT64 total, UINT64 n) {
+    if (n > counts->size())
+        n = counts->size();
+    std::partial_sort(counts->begin(), counts->begin() + n, counts->end(),
+        more_misses);
+
+    *outstream << "=====" << std::endl;
+    *outstream << title << " (top " << uint_to_string(n) << "):" <<
+        std::endl;
+    for (UINT64 i = 0; i < n; i++) {
+        miss_count *count = &(*counts)[i];
+        *outstream << "\t" << count->name << ": " <<
+            uint_to_string(count->misses) << " / " << uint_to_string(total) <<
+            " = " << double_to_string(count->misses/(double)total) <<
+            std::endl;
+    }
+}
+
+static VOID append_counts(const std::map<string, UINT64> &totals,
+    vector<miss_count> *counts) {
+    std::map<string, UINT64>::const_iterator it;
+    for (it = totals.begin(); it != totals.end(); it++) {
+        miss_count count = {it->first, it->second};
+        counts->push_back(count);
+    }
+}
+
+static string function_name(ADDRINT ip) {
+    string function = RTN_FindNameByAddress(ip);
+    return function.empty() ? "?" : function;
+}
+
+static string source_location(ADDRINT ip) {
+    INT32 line;
+    string file;
+    PIN_GetSourceLocation(ip, NULL, &line, &file);
+    return file.empty() ? "?" : file + ":" + uint_to_string(line);
+}
+
+static string instruction_name(ADDRINT ip) {
+    return function_name(ip) + " (" + source_location(ip) + ")";
+}
+
+// reports which instructions missed the most in a level, and adds them up
+// by function and by source line
+static VOID output_misses_by_ip(std::ostream *outstream, Cache *cache) {
+    AddrMap<ip_misses> *misses = cache->get_misses_by_ip();
+    vector<miss_count> by_ip, by_function, by_line;
+    std::map<string, UINT64> function_totals, line_totals;
+    UINT64 total = 0;
+
+    for (UINT64 i = 0; i < misses->slots(); i++) {
+        ADDRINT ip = misses->key_at(i);
+        if (ip == ARQSIMUHASH_EMPTY)
+            continue;
+        ip_misses *ip_count = misses->value_at(i);
+        UINT64 n = ip_count->reads + ip_count->writes;
+
+        string function = function_name(ip);
+        string location = source_location(ip);
+
+        miss_count count = {hex_to_string(ip) + " " + function + " (" +
+            location + ", " + uint_to_string(ip_count->reads) + " reads, " +
+            uint_to_string(ip_count->writes) + " writes)", n};
+        by_ip.push_back(count);
+        function_totals[function] += n;
+        line_totals[location] += n;
+        total += n;
+    }
+    append_counts(function_totals, &by_function);
+    append_counts(line_totals, &by_line);
+
+    string level = cache->get_description();
+    output_top_misses(outstream, level + " misses by instruction", &by_ip,
+        total, knob_top_misses);
+    output_top_misses(outstream, level + " misses by function",
+        &by_function, total, knob_top_misses);
+    output_top_misses(outstream, level + " misses by source line", &by_line,
+        total, knob_top_misses);
+}
+
+// reports which instructions loaded the lines of a level whose bytes went
+// unused the most
+static VOID output_utilization_by_ip(std::ostream *outstream, Cache *cache) {
+    AddrMap<ip_utilization> *utilization = cache->get_utilization_by_ip();
+    vector<miss_count> by_ip;
+    UINT64 total = 0;
+
+    for (UINT64 i = 0; i < utilization->slots(); i++) {
+        ADDRINT ip = utilization->key_at(i);
+        if (ip == ARQSIMUHASH_EMPTY)
+            continue;
+        ip_utilization *ip_lines = utilization->value_at(i);
+        UINT64 bytes = ip_lines->lines*cache->get_line_len();
+
+        miss_count count = {hex_to_string(ip) + " " + function_name(ip) +
+            " (" + source_location(ip) + ", " +
+            uint_to_string(ip_lines->lines) + " lines, " +
+            double_to_string(ip_lines->used_bytes/(double)bytes) + " used)",
+            bytes - ip_lines->used_bytes};
+        by_ip.push_back(count);
+        total += count.misses;
+    }
+
+    output_top_misses(outstream, cache->get_description() +
+        " unused bytes of evicted lines by loading instruction", &by_ip,
+        total, knob_utilization);
+}
+
+static string site_name(UINT32 site) {
+    if (site == ARQSIMUALLOC_STACK)
+        return "stacks";
+    if (site == ARQSIMUALLOC_GLOBALS)
+        return "global data";
+    if (site == ARQSIMUALLOC_UNKNOWN)
+        return "elsewhere";
+
+    ADDRINT ip = alloc_sites->get_ip(site);
+    return "heap, allocated at " + hex_to_string(ip) + " " +
+        function_name(ip) + " (" + source_location(ip) + ", " +
+        uint_to_string(alloc_sites->get_allocations(site)) + " allocations)";
+}
+
+static string core_name(UINT32 core) {
+    return coherent->describe_core(core);
+}
+
+static VOID output_misses_by_site(std::ostream *outstream, Cache *cache,
+    UINT32 level) {
+    vector<miss_count> by_site;
+    UINT64 total = 0;
+
+    for (UINT32 i = 0; i < alloc_sites->get_sites(); i++) {
+        miss_count count = {site_name(i), alloc_sites->get_misses(i, level)};
+        total += count.misses;
+        by_site.push_back(count);
+    }
+
+    output_top_misses(outstream, cache->get_description() +
+        " misses by allocation site", &by_site, total, knob_alloc_sites);
+}
+
 static VOID finalize(INT32 code, VOID *v) {
+    if (ring) {
+        for (UINT32 i = 0; i < configs.size(); i++) {
+            outfile << "=====" << std::endl;
+            outfile << "configuration " << uint_to_string(i + 1) << ": " <<
+                describe_hierarchy_config(configs[i]) << std::endl;
+            config_memories[i]->output(&outfile);
+        }
+        output_throughput(&outfile, "parallel", published);
+        outfile.close();
+        return;
+    }
+
+    if (partitioned) {
+        front_memory->output(&outfile);
+        output_throughput(&outfile, "partitioned", published);
+        outfile.close();
+        return;
+    }
+
+    if (coherent) {
+        coherent->output(&outfile);
+        if (sharing)
+            sharing->output(&outfile, knob_false_sharing, instruction_name,
+                site_name, core_name);
+        output_throughput(&outfile, knob_buffer ? "buffered" : "direct",
+            coherent->get_accesses());
+        outfile.close();
+        return;
+    }
+
+    // hits resolved by the filters never reached L1
+    UINT64 read_hits = 0, write_hits = 0, lookups = 0;
+    for (UINT32 i = 0; i < ARQSIMUCACHE_MAXTHREADS; i++) {
+        read_hits += filters[i].read_hits;
+        write_hits += filters[i].write_hits;
+        lookups += filters[i].lookups;
+    }
+    front_memory->count_hits(read_hits, write_hits);
+
+    // and they're in the last page translated, which the L1 TLB holds
+    if (tlbs) {
+        tlbs->count_hits(read_hits + write_hits);
+        tlbs->output(&outfile);
+    }
     front_memory->output(&outfile);
+    if (knob_top_misses) {
+        output_misses_by_ip(&outfile, l1_cache);
+        output_misses_by_ip(&outfile, l2_cache);
+    }
+    if (alloc_sites) {
+        output_misses_by_site(&outfile, l1_cache, 0);
+        output_misses_by_site(&outfile, l2_cache, 1);
+    }
+    if (knob_utilization) {
+        output_utilization_by_ip(&outfile, l1_cache);
+        output_utilization_by_ip(&outfile, l2_cache);
+    }
+    if (access_patterns)
+        access_patterns->output(&outfile, knob_access_patterns,
+            instruction_name);
+    if (stack_distance) {
+        stack_distance->count_repeats(read_hits + write_hits);
+        stack_distance->output(&outfile);
+    }
+    output_throughput(&outfile, knob_buffer ? "buffered" : "direct",
+        read_hits + write_hits + lookups);
     outfile.close();
 }
 
+// main memory below L2, as the knobs describe it
+static Memory *make_main_memory() {
+    if (knob_memory.Value() == "ram")
+        return new RAM();
+
+    return new DRAM(knob_dram_channels, knob_dram_ranks, knob_dram_banks,
+        knob_dram_row_len, knob_l2_line_len, knob_dram_mapping,
+        knob_dram_page_policy.Value() == "open", knob_dram_trcd,
+        knob_dram_tcas, knob_dram_trp);
+}
+
 static INT32 usage() {
     PIN_ERROR("This Pintool simulates a cache hierarchy\n" +
         KNOB_BASE::StringKnobSummary() + "\n");
@@ -49,15 +941,350 @@ int main(int argc, char *argv[])
 
 
     outfile.open("arqsimucache.out");
+    start_time = wall_time();
+
+    // the filter's hits can't be told apart by set, which the confidence
+    // intervals of sampling need, so sampling goes without it
+    // an L1 prefetcher has to see every access, and so do access patterns
+    // and line utilization (other bytes of the line may be used); an
+    // inclusive L2 may invalidate the last line; write through and
+    // no write allocate L1s send repeated writes on, and write buffers and
+    // misses in flight run on the time of every access
+    bool non_inclusive = (knob_l2_inclusion.Value() == "non_inclusive");
+    bool miss_tracking = (knob_l1_mshrs || knob_l2_mshrs);
+    bool write_policies = (knob_l1_write_policy.Value() != "write_back" ||
+        knob_l2_write_policy.Value() != "write_back" ||
+        !knob_l1_write_allocate || !knob_l2_write_allocate ||
+        knob_l1_write_buffer || knob_l2_write_buffer);
+    use_filter = knob_same_line_filter && knob_sample_sets == 1 &&
+        !repeated_hits_matter(knob_l1_policy) &&
+        knob_l1_prefetcher.Value() == "none" && !knob_access_patterns &&
+        !knob_utilization && knob_l2_inclusion.Value() != "inclusive" &&
+        !write_policies && !miss_tracking && !knob_coherence;
+
+    if (!is_replacement_policy(knob_l1_policy) ||
+        !is_replacement_policy(knob_l2_policy))
+        return usage();
+
+    bool prefetching = (knob_l1_prefetcher.Value() != "none" ||
+        knob_l2_prefetcher.Value() != "none");
+    // prefetches reach other sets, so they can't be split by set, and
+    // neither can the traffic between inclusive or exclusive levels; the
+    // hierarchies of configs have neither
+    if ((prefetching || !non_inclusive) && (knob_partition_workers ||
+        knob_sample_sets != 1 || !knob_configs.Value().empty()))
+        return usage();
+    // write buffers see the writes of every set, in order
+    if (write_policies && (knob_partition_workers ||
+        !knob_configs.Value().empty()))
+        return usage();
+    if ((knob_l1_write_buffer || knob_l2_write_buffer) &&
+        knob_sample_sets != 1)
+        return usage();
+    // an exclusive L2 takes L1 victims by itself, and can't hold the lines
+    // a write through L1 writes; it never gets writes of its own either,
+    // so its write policy wouldn't apply
+    if (knob_l2_inclusion.Value() == "exclusive" &&
+        (knob_l1_write_policy.Value() != "write_back" ||
+        knob_l1_write_buffer ||
+        knob_l2_write_policy.Value() != "write_back" ||
+        !knob_l2_write_allocate))
+        return usage();
+
+    // a victim cache holds lines of every set; between L1 and L2, it
+    // would hold lines an inclusive L2 doesn't, and an exclusive L2 takes
+    // the L1 victims itself
+    bool victim_caches = (knob_l1_victim_cache || knob_l2_victim_cache);
+    if (victim_caches && (knob_partition_workers || knob_sample_sets != 1 ||
+        !knob_configs.Value().empty()))
+        return usage();
+    if (knob_l1_victim_cache && !non_inclusive)
+        return usage();
+
+    // the row buffers of DRAM see the misses of every set, in order
+    bool dram = (knob_memory.Value() == "dram");
+    UINT32 dram_order[ARQSIMUDRAM_FIELDS];
+    if (knob_memory.Value() != "ram" && !dram)
+        return usage();
+    if (dram && (knob_partition_workers || knob_sample_sets != 1 ||
+        !knob_configs.Value().empty() ||
+        !parse_mapping(knob_dram_mapping, dram_order) ||
+        !is_dram_geometry(knob_dram_channels, knob_dram_ranks,
+            knob_dram_banks, knob_dram_row_len, knob_l2_line_len) ||
+        (knob_dram_page_policy.Value() != "open" &&
+        knob_dram_page_policy.Value() != "closed")))
+        return usage();
+
+    // misses in flight are timed against the accesses to every set; an
+    // exclusive L2 takes the misses of L1 without going through its own
+    if (miss_tracking && (knob_partition_workers ||
+        knob_sample_sets != 1 || !knob_configs.Value().empty()))
+        return usage();
+    if (knob_l2_mshrs && knob_l2_inclusion.Value() == "exclusive")
+        return usage();
+    // the next level takes a request every interval cycles, at least one
+    if ((knob_l1_mshrs && !knob_l1_request_interval) ||
+        (knob_l2_mshrs && !knob_l2_request_interval))
+        return usage();
+
+    // page walks read entries of every set, in the order of the accesses
+    if (knob_tlb && (knob_partition_workers || knob_sample_sets != 1 ||
+        !knob_configs.Value().empty() || !is_page_size(knob_page_size) ||
+        !is_tlb_geometry(knob_dtlb_entries, knob_dtlb_ways) ||
+        !is_tlb_geometry(knob_stlb_entries, knob_stlb_ways)))
+        return usage();
+    // private L1s only come with the basic hierarchy, simulated by the
+    // threads of the target as they go; L1 lines are kept coherent in L2,
+    // so they can't be longer than its lines
+    if (knob_coherence && (knob_partition_workers ||
+        knob_sample_sets != 1 || !knob_configs.Value().empty() ||
+        prefetching || !non_inclusive || write_policies || victim_caches ||
+        dram || miss_tracking || knob_tlb || knob_top_misses ||
+        knob_alloc_sites || knob_utilization || knob_access_patterns ||
+        knob_stack_distance || knob_l2_line_len < knob_l1_line_len))
+        return usage();
+    if (knob_false_sharing && !knob_coherence)
+        return usage();
+    if (knob_victim_cache_kind.Value() != "victim" &&
+        knob_victim_cache_kind.Value() != "miss")
+        return usage();
+    // hierarchies of their own take the references the partitioned one
+    // would, and their workers stop in another way
+    if (knob_partition_workers && !knob_configs.Value().empty())
+        return usage();
+
+    if (!knob_configs.Value().empty()) {
+        if (!parse_hierarchy_configs(knob_configs, &configs) ||
+            !knob_ring_slots)
+            return usage();
+
+        ring = new BatchRing(knob_ring_slots, 4096, configs.size());
+        PIN_InitLock(&ring_lock);
+
+        for (UINT32 i = 0; i < configs.size(); i++) {
+            config_memories.push_back(make_hierarchy(configs[i].l1_size,
+                configs[i].l1_ways, configs[i].l1_line_len,
+                configs[i].l2_size, configs[i].l2_ways,
+                configs[i].l2_line_len, configs[i].l1_policy,
+                configs[i].l2_policy));
+
+            PIN_THREAD_UID uid;
+            if (PIN_SpawnInternalThread(run_worker, (VOID *)(ADDRINT)i, 0,
+                    &uid) == INVALID_THREADID)
+                return usage();
+            workers.push_back(uid);
+        }
+
+        PIN_AddPrepareForFiniFunction(stop_workers, 0);
+    }
+
+    // misses are only told apart when the tool calls the hierarchy itself,
+    // and allocations have to be seen at the same time as the accesses, so
+    // the hierarchy can't lag behind in buffers
+    if ((knob_top_misses || knob_alloc_sites || knob_utilization) &&
+        (knob_partition_workers || !knob_configs.Value().empty()))
+        return usage();
+    if (knob_alloc_sites && knob_buffer)
+        return usage();
+    // access patterns need every access of an instruction, in order
+    if (knob_access_patterns && (knob_partition_workers ||
+        !knob_configs.Value().empty() || knob_sample_sets != 1))
+        return usage();
+    // symbols tell where the instructions are
+    if (knob_top_misses || knob_alloc_sites || knob_utilization ||
+        knob_access_patterns || knob_false_sharing)
+        PIN_InitSymbols();
+
+    if (knob_access_patterns)
+        access_patterns = new AccessPatterns(knob_l1_line_len,
+            knob_pattern_ips);
+
+    if (knob_partition_workers || knob_sample_sets != 1 || prefetching ||
+        knob_top_misses || knob_alloc_sites || knob_utilization ||
+        !non_inclusive || write_policies || victim_caches || dram ||
+        miss_tracking) {
+        // the caches have to be generic ones, that simulate each level on
+        // its own, sample it, prefetch, count misses, track utilization,
+        // keep levels inclusive or exclusive, change their write policy,
+        // have victim caches or DRAM below or track misses in flight
+        bool miss_caches = (knob_victim_cache_kind.Value() == "miss");
+        Memory *below_l2 = make_main_memory();
+        if (knob_l2_victim_cache)
+            below_l2 = new VictimCache("L2 " + knob_victim_cache_kind.Value() +
+                " cache", below_l2, knob_l2_victim_cache, knob_l2_line_len,
+                miss_caches);
+        l2_cache = new Cache("L2", below_l2, knob_l2_size, knob_l2_ways,
+            knob_l2_line_len, knob_l2_policy);
+
+        Memory *below_l1 = l2_cache;
+        if (knob_l1_victim_cache)
+            below_l1 = new VictimCache("L1 " + knob_victim_cache_kind.Value() +
+                " cache", below_l1, knob_l1_victim_cache, knob_l1_line_len,
+                miss_caches);
+        l1_cache = new Cache("L1", below_l1, knob_l1_size, knob_l1_ways,
+            knob_l1_line_len, knob_l1_policy);
+        front_memory = l1_cache;
+    }
+
+    if (!non_inclusive && !l2_cache->set_inclusion(knob_l2_inclusion,
+        l1_cache))
+        return usage();
+
+    if (write_policies) {
+        if (!l1_cache->set_write_policy(knob_l1_write_policy,
+                knob_l1_write_allocate) ||
+            !l2_cache->set_write_policy(knob_l2_write_policy,
+                knob_l2_write_allocate))
+            return usage();
+        if (knob_l1_write_buffer)
+            l1_cache->set_write_buffer(knob_l1_write_buffer);
+        if (knob_l2_write_buffer)
+            l2_cache->set_write_buffer(knob_l2_write_buffer);
+    }
+
+    if (knob_l1_mshrs) {
+        l1_cache->track_misses(knob_l1_mshrs, knob_l1_request_interval,
+            knob_l1_request_queue);
+    }
+    if (knob_l2_mshrs) {
+        l2_cache->track_misses(knob_l2_mshrs, knob_l2_request_interval,
+            knob_l2_request_queue);
+    }
+
+    if (knob_top_misses) {
+        l1_cache->track_misses_by_ip();
+        l2_cache->track_misses_by_ip();
+    }
+
+    if (knob_utilization) {
+        l1_cache->track_utilization();
+        l2_cache->track_utilization();
+    }
+
+    // the sharing detector names the allocation sites of the lines it
+    // reports
+    if (knob_alloc_sites || knob_false_sharing) {
+        alloc_sites = new AllocationSites();
+        PIN_InitLock(&alloc_lock);
+        IMG_AddInstrumentFunction(instrument_image, 0);
+        PIN_AddThreadStartFunction(start_thread, 0);
+    }
+    if (knob_alloc_sites) {
+        l1_cache->set_miss_observer(alloc_sites, 0);
+        l2_cache->set_miss_observer(alloc_sites, 1);
+    }
+
+    if (prefetching) {
+        string names[2] = {knob_l1_prefetcher, knob_l2_prefetcher};
+        Cache *levels[2] = {l1_cache, l2_cache};
+        UINT64 line_lens[2] = {knob_l1_line_len, knob_l2_line_len};
+
+        for (UINT32 i = 0; i < 2; i++) {
+            if (names[i] == "none")
+                continue;
+            if (!is_prefetcher(names[i]))
+                return usage();
+            levels[i]->set_prefetcher(make_prefetcher(names[i],
+                line_lens[i], knob_prefetch_degree));
+        }
+    }
+
+    if (knob_sample_sets != 1) {
+        // sampled sets are picked by the address bits right above the
+        // longest line, which are part of the index of both levels
+        UINT64 sample_bits = log2((int)knob_sample_sets.Value());
+        if (knob_sample_sets != (1ULL << sample_bits) ||
+            !knob_configs.Value().empty() || knob_partition_workers ||
+            knob_stack_distance)
+            return usage();
+
+        UINT64 line_len = knob_l1_line_len > knob_l2_line_len ?
+            knob_l1_line_len : knob_l2_line_len;
+        sample_shift = log2((int)line_len);
+        sample_mask = knob_sample_sets - 1;
+        if (!l1_cache->sample(sample_shift, sample_mask) ||
+            !l2_cache->sample(sample_shift, sample_mask))
+            return usage();
+    }
+
+    if (knob_partition_workers) {
+        partitioned = new PartitionedHierarchy(l1_cache, l2_cache,
+            knob_partition_workers);
+        PIN_InitLock(&partition_lock);
+
+        for (UINT32 i = 0; i < knob_partition_workers; i++) {
+            PIN_THREAD_UID uid;
+            if (PIN_SpawnInternalThread(run_partition_worker,
+                    (VOID *)(ADDRINT)i, 0, &uid) == INVALID_THREADID)
+                return usage();
+            workers.push_back(uid);
+        }
+
+        PIN_AddPrepareForFiniFunction(stop_partition_workers, 0);
+    }
+
+    if (knob_buffer || ring || partitioned) {
+        TRACE_BUFFER_CALLBACK process = process_buffer;
+        if (ring)
+            process = publish_buffer;
+        else if (partitioned)
+            process = partition_buffer;
+        buffer_id = PIN_DefineTraceBuffer(sizeof(memref), knob_buffer_pages,
+            process, 0);
+        if (buffer_id == BUFFER_ID_INVALID)
+            return usage();
+    }
 
     INS_AddInstrumentFunction(instrument_instruction, 0);
     PIN_AddFiniFunction(finalize, 0);
 
-    RAM *ram = new RAM();
-    Cache *l2 = new Cache("L2", ram, 1000*1024, 2, 16);
-    Cache *l1 = new Cache("L1", l2, 64*1024, 2, 16);
+    if (knob_coherence) {
+        l2_cache = new Cache("L2", new RAM(), knob_l2_size, knob_l2_ways,
+            knob_l2_line_len, knob_l2_policy);
+        coherent = new CoherentHierarchy(l2_cache, knob_l1_size,
+            knob_l1_ways, knob_l1_line_len, knob_l1_policy);
+        if (knob_false_sharing) {
+            sharing = new SharingDetector(ARQSIMUCOHERENCE_STRIPES,
+                knob_l1_line_len, find_alloc_site);
+            coherent->set_sharing_detector(sharing);
+        }
+        l1_key = PIN_CreateThreadDataKey(0);
+        if (l1_key == INVALID_TLS_KEY)
+            return usage();
+        PIN_AddThreadStartFunction(start_core, 0);
+    }
+
+    // common geometries get a hierarchy specialized at compile time
+    if (!l1_cache && !coherent) {
+        front_memory = make_hierarchy(knob_l1_size, knob_l1_ways,
+            knob_l1_line_len, knob_l2_size, knob_l2_ways, knob_l2_line_len,
+            knob_l1_policy, knob_l2_policy);
+    }
+
+    if (knob_tlb) {
+        tlbs = new DataTLBs(front_memory, knob_page_size, knob_dtlb_entries,
+            knob_dtlb_ways, knob_stlb_entries, knob_stlb_ways);
+    }
+
+    if (knob_stack_distance) {
+        // the grid doubles the set count from min_sets up to max_sets, and
+        // has at least one way
+        UINT64 min_bits = log2((int)knob_sd_min_sets.Value());
+        UINT64 max_bits = log2((int)knob_sd_max_sets.Value());
+        if (knob_sd_min_sets != (1ULL << min_bits) ||
+            knob_sd_max_sets != (1ULL << max_bits) ||
+            knob_sd_min_sets > knob_sd_max_sets || !knob_sd_max_ways)
+            return usage();
+
+        stack_distance = new StackDistance(knob_l1_line_len,
+            knob_sd_min_sets, knob_sd_max_sets, knob_sd_max_ways);
+    }
 
-    front_memory = l1;
+    l1_offset_len = log2((int)knob_l1_line_len.Value());
+    for (UINT32 i = 0; i < ARQSIMUCACHE_MAXTHREADS; i++) {
+        filters[i].line = ARQSIMUCACHE_NOTAG;
+        filters[i].dirty_line = ARQSIMUCACHE_NOTAG;
+    }
 
     // start program and never return
     PIN_StartProgram();
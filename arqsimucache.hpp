@@ -1,35 +1,91 @@
+#ifndef __ARQSIMUCACHE_HPP__
+#define __ARQSIMUCACHE_HPP__
+
 #include "arqsimucommons.h"
+#include "arqsimuwaymatch.h"
+#include "arqsimupolicy.hpp"
+#include "arqsimuprefetch.hpp"
+#include "arqsimuhash.h"
 
 #define ARQSIMUCACHE_RAMOH 8
 #define ARQSIMUCACHE_L1OH 1
 #define ARQSIMUCACHE_L2OH 2
 
-class Line {
-    private:
-        UINT64 tag;
-        bool dirty;
-    
-    public:
-        Line(UINT64 ptag = 0);
+// Tag stored in ways that hold no line. get_tag() shifts out at least one
+// bit, so it never produces this value and lookups can compare tags only.
+#define ARQSIMUCACHE_NOTAG 0xFFFFFFFFFFFFFFFFULL
 
-        UINT64 get_tag();
-        VOID mark_dirty();
-        bool is_dirty();
-};
+// address used to mean no line at all
+#define ARQSIMUCACHE_NOLINE ((VOID *)ARQSIMUCACHE_NOTAG)
 
-class Set {
+#define ARQSIMUCACHE_VALID 0x1
+#define ARQSIMUCACHE_DIRTY 0x2
+// loaded by a prefetch, and not used yet
+#define ARQSIMUCACHE_PREFETCHED 0x4
+
+// Every line of a cache, kept as flat arrays indexed by set*ways + way so
+// that an access touches a couple of contiguous cache lines of the host and
+// never allocates. Which line to replace is up to a ReplacementPolicy.
+class TagStore {
     private:
         UINT64 ways;
-        list<Line> lines;
+        vector<UINT64> tags;
+        vector<UINT8> flags;
 
     public:
-        Set(UINT64 nways = 1);
+        TagStore(UINT64 nsets = 0, UINT64 nways = 1);
+
+        // returns the way holding tag in the set, or -1 if it's not there
+        INT32 find(UINT64 index, UINT64 tag);
+        // same, for callers that know the number of ways at compile time
+        template <UINT64 WAYS> INT32 find(UINT64 index, UINT64 tag) {
+            return find_way(&tags[index*WAYS], WAYS, tag);
+        }
+        // returns a way of the set that holds no line, or -1 if it's full
+        INT32 find_free(UINT64 index);
+        VOID fill(UINT64 index, UINT32 way, UINT64 tag);
+
+        UINT64 get_tag(UINT64 index, UINT32 way);
+        bool is_valid(UINT64 index, UINT32 way);
+        bool is_dirty(UINT64 index, UINT32 way);
+        VOID mark_dirty(UINT64 index, UINT32 way);
+        bool is_prefetched(UINT64 index, UINT32 way);
+        VOID mark_prefetched(UINT64 index, UINT32 way);
+        VOID clear_prefetched(UINT64 index, UINT32 way);
+        // frees a way, as if it had never been filled
+        VOID invalidate(UINT64 index, UINT32 way);
+};
 
-        bool is_present(UINT64 tag);
-        bool is_full();
-        Line *get_line(UINT64 tag);
-        VOID load_line(Line line);
-        Line unload_line();
+// A memory reference as collected by the tools, one per memory operand
+struct memref {
+    ADDRINT ip;
+    ADDRINT addr;
+    UINT32 size;
+    UINT32 is_write;
+};
+
+// misses of a cache level caused by an instruction
+struct ip_misses {
+    UINT64 reads, writes;
+};
+
+// lines an instruction loaded into a cache level and that were evicted
+// since, and how many of their bytes were used while they stayed
+struct ip_utilization {
+    UINT64 lines, used_bytes;
+};
+
+// evicted lines are counted by the eighth of their bytes used: bucket 0 for
+// the lines never used, bucket b for the ones that used up to b/8
+#define ARQSIMUCACHE_UTIL_BUCKETS 9
+
+// Gets told about every miss of the cache levels it's attached to, each of
+// which has a number of its own
+class MissObserver {
+    public:
+        virtual ~MissObserver() {}
+        virtual VOID miss(UINT32 level, VOID *ip, VOID *addr,
+            bool is_write) = 0;
 };
 
 class Memory {
@@ -38,10 +94,24 @@ class Memory {
 
     public:
         Memory(UINT64 poverhead = 0);
-        // read() and write() return the overhead in cycles of the operation
-        virtual UINT64 read(VOID *addr);
-        virtual UINT64 write(VOID *addr);
+        // read() and write() return the overhead in cycles of the operation;
+        // ip is the instruction that made it, if the level knows it, and
+        // size the number of bytes accessed from addr on
+        virtual UINT64 read(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        virtual UINT64 write(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        // the level above dropped the line of size bytes at addr; levels
+        // that keep the lines others evict take it, and the rest only take
+        // the write back of a dirty one, as a write()
+        virtual UINT64 evicted(VOID *addr, UINT32 size, bool dirty);
+        // the level above got to time now; levels that keep time of their
+        // own catch up, the rest ignore it
+        virtual VOID advance_to(UINT64 now);
+        // whether evicted() does anything with clean lines
+        virtual bool takes_evicted();
         virtual VOID output(std::ostream *outstream) = 0;
+        // accounts for hits to this level that the tool resolved on its own,
+        // without calling read() or write()
+        virtual VOID count_hits(UINT64 read_hits, UINT64 write_hits);
         virtual VOID set_overhead(UINT64 new_overhead);
         virtual UINT64 get_overhead();
 };
@@ -52,13 +122,176 @@ class RAM : public Memory {
         virtual VOID output(std::ostream *outstream);
 };
 
+// Write back / write combining buffer at the output of a cache level: the
+// lines the level writes to the next one wait here, and go out one at a
+// time in the background, each taking as long as the next level says.
+// Writes to a line that is still waiting are combined with it, and a write
+// that finds the buffer full stalls until the oldest line starts going out.
+// Reads of a waiting line are served by the buffer. Victims of the level
+// go out as such, with next->evicted(), and the rest as writes.
+class WriteBuffer {
+    private:
+        struct entry {
+            ADDRINT line;
+            bool victim;
+        };
+
+        Memory *next;
+        UINT64 line_len;
+        // waiting lines, oldest first, in a ring
+        vector<entry> lines;
+        UINT64 head, count;
+        // when the next level is done with the line going out
+        UINT64 busy_until;
+        UINT64 writes, combined, stalls, stall_cycles, forwarded_reads;
+        UINT64 occupancy_sum, max_occupancy;
+
+        // position of line in the ring, or -1 if it's not waiting
+        INT64 find(ADDRINT line);
+        // sends out the lines whose turn has come by now
+        VOID drain(UINT64 now);
+
+    public:
+        WriteBuffer(Memory *pnext = NULL, UINT64 entries = 8,
+            UINT64 pline_len = 16);
+
+        // takes a write at time now, of a dirty victim of the level or
+        // not, and returns how many cycles it stalled
+        UINT64 write(VOID *addr, UINT64 now, bool victim = false);
+        // whether the line of addr is waiting, so that the read is served
+        // by the buffer
+        bool read(VOID *addr, UINT64 now);
+        // sends out every line still waiting, once there are no more writes
+        VOID flush();
+        VOID output(std::ostream *outstream);
+};
+
+// Misses of a cache level in flight (its miss status holding registers,
+// MSHRs) and the queue of its requests to the next level. A level that
+// tracks its misses doesn't wait for them: it goes on with the next access
+// while up to capacity misses are in flight, and only stalls when they're
+// all taken or the queue is full. The next level takes a request every
+// interval cycles, and the rest wait in the queue. Accesses to a line in
+// flight wait for it, coalesced with the miss that asked for it.
+class MissTracker {
+    private:
+        struct in_flight {
+            ADDRINT line;
+            UINT64 ready;
+        };
+
+        vector<in_flight> entries;
+        UINT64 capacity, interval, queue_depth;
+        // when the next level takes another request; the requests waiting
+        // go out back to back until then
+        UINT64 link_free;
+        UINT64 misses, coalesced, mshr_stalls, mshr_stall_cycles;
+        UINT64 queue_stalls, queue_stall_cycles;
+        UINT64 occupancy_sum, max_occupancy, queued_sum, max_queued;
+
+        VOID retire(UINT64 now);
+        UINT64 queued(UINT64 now);
+
+    public:
+        MissTracker(UINT64 pcapacity = 8, UINT64 pinterval = 1,
+            UINT64 pqueue_depth = 8);
+
+        // cycles an access at time now waits for line, if it's in flight
+        UINT64 wait(ADDRINT line, UINT64 now);
+        // takes a miss at time now: returns the cycles the level stalled
+        // before it could queue it, and sets issue to when it goes out
+        UINT64 allocate(ADDRINT line, UINT64 now, UINT64 *issue);
+        // the line of the last miss taken arrives at ready
+        VOID complete(ADDRINT line, UINT64 ready);
+        VOID output(std::ostream *outstream);
+};
+
+// overhead in cycles of a hit in the cache level with the given description
+UINT64 cache_overhead(string description);
+// writes the hit ratios of a cache level the way every level reports them
+VOID output_cache_stats(std::ostream *outstream, string description,
+    UINT64 reads, UINT64 read_hits, UINT64 writes, UINT64 write_hits,
+    UINT64 splits, string policy);
+// whether size bytes from addr span more than one line of line_len bytes
+bool crosses_line(VOID *addr, UINT32 size, UINT64 line_len);
+
 class Cache : public Memory {
     private:
         string description;
         Memory *next;
-        vector<Set> sets;
+        TagStore lines;
+        ReplacementPolicy *policy;
         int  ways, line_len, size;
-        int reads, writes, read_hits, write_hits;
+        // reads and writes count accesses to single lines; an access that
+        // spans several lines counts once for each, and once as a split
+        UINT64 reads, writes, read_hits, write_hits, splits;
+        // address split, computed once from the geometry
+        UINT64 offset_bits, index_bits, index_bitmask;
+
+        // set sampling: only the sets whose address bits selected by
+        // sample_shift and sample_mask are zero see accesses, and they count
+        // them one by one to estimate how much the hit ratios can be off
+        struct set_counts {
+            UINT64 reads, read_hits, writes, write_hits;
+        };
+        UINT64 sample_shift, sample_mask;
+        vector<set_counts> sampled_counts;
+
+        // the sum of the overheads of the accesses so far, which tells
+        // when a prefetched line would have arrived, or when the write
+        // buffer gets to write a line
+        UINT64 clock;
+
+        Prefetcher *prefetcher;
+        vector<UINT64> ready_at;
+        // lines evicted by prefetches, set while they haven't been loaded
+        // again
+        AddrMap<UINT8> evicted_by_prefetch;
+        UINT64 prefetches, useful_prefetches, late_prefetches,
+            pollution_evictions;
+
+        // misses by instruction, if they're tracked
+        AddrMap<ip_misses> *misses_by_ip;
+        MissObserver *observer;
+        UINT32 observer_level;
+        VOID count_miss(VOID *ip, VOID *addr, bool is_write);
+
+        // line utilization, if it's tracked: the bytes of each line used
+        // since it was loaded, one bit per chunk of chunk_len bytes (lines
+        // have at most 64 chunks), and the instruction that loaded it
+        vector<UINT64> used_chunks;
+        vector<ADDRINT> loaded_by;
+        UINT64 chunk_len, chunks;
+        UINT64 utilization_counts[ARQSIMUCACHE_UTIL_BUCKETS];
+        AddrMap<ip_utilization> *utilization_by_ip;
+        VOID use_bytes(UINT64 index, UINT32 way, VOID *addr, UINT32 size);
+        VOID count_eviction(UINT64 index, UINT32 way);
+        VOID output_utilization(std::ostream *outstream);
+
+        // inclusion with respect to the level above: an inclusive level
+        // knows the level above, to invalidate there the lines it evicts,
+        // and the level above an exclusive one knows it, to fill it with
+        // its victims and take lines from it; evict() leaves clean victims
+        // in clean_victim if some level takes them (keep_clean_victims), for
+        // exclusive_lower or next->evicted(), so that levels with neither
+        // never write it, and stay safe to share between threads
+        string inclusion;
+        Cache *inclusive_upper, *exclusive_lower;
+        bool keep_clean_victims;
+        VOID *clean_victim;
+        UINT64 back_invalidations, dirty_back_invalidations;
+        UINT64 victim_fills, moves_up;
+        // the line in way is about to be replaced: returns it if it has to
+        // be written back, or ARQSIMUCACHE_NOLINE
+        VOID *evict(UINT64 index, UINT32 way);
+        // drops the lines in len bytes from addr, and returns how many
+        // there were; dirty_lines is increased by the dirty ones
+        UINT32 invalidate(VOID *addr, UINT64 len, UINT64 *dirty_lines);
+        // for an exclusive level: takes a line evicted by the level above,
+        // and gives it a line it holds (dropping it) or reads it from next
+        UINT64 insert_victim(VOID *addr, bool dirty);
+        UINT64 move_up(VOID *addr, VOID *ip, bool *dirty);
+        VOID output_inclusion(std::ostream *outstream);
         
         UINT64 index_len();
         UINT64 index_mask();
@@ -66,80 +299,409 @@ class Cache : public Memory {
         VOID* make_addr(UINT64 tag, UINT64 index);
         UINT64 get_index(VOID *addr);
         UINT64 get_tag(VOID *addr);
+        // sends what a miss needs to the next level: the read of the
+        // missing line, and the write back of the victim, if there is one
+        UINT64 forward_miss(VOID *addr, VOID *victim, VOID *ip);
+        VOID *line_addr(VOID *addr);
+
+        // write policy: written lines are either marked dirty (write back)
+        // or every write goes on to the next level (write through), and a
+        // write miss either loads the line (write allocate) or only goes on
+        // to the next level; writes to the next level may go through a
+        // write buffer, which the level's clock drives
+        bool write_through, write_allocate;
+        WriteBuffer *write_buffer;
+        UINT64 writes_forwarded;
+        bool hit_local(VOID *addr, bool is_write, UINT32 size);
+        UINT64 write_next(VOID *addr, VOID *ip, UINT32 size);
+        // sends a dirty victim down, as an eviction rather than a write
+        UINT64 write_back(VOID *victim);
+        UINT64 read_next(VOID *addr, VOID *ip, UINT32 size);
+        VOID output_write_policy(std::ostream *outstream);
+
+        // misses in flight, if the level doesn't wait for them
+        MissTracker *miss_tracker;
+        // forwards a miss, through the tracker if there is one; returns the
+        // cycles until the line arrives, and sets stall to those the level
+        // itself couldn't go on
+        UINT64 send_miss(VOID *addr, VOID *victim, VOID *ip, UINT64 *stall);
+        UINT64 read_line(VOID *addr, VOID *ip, UINT32 size);
+        UINT64 write_line(VOID *addr, VOID *ip, UINT32 size);
+        // accesses each line of an access that spans several, one by one
+        UINT64 split_access(VOID *addr, VOID *ip, UINT32 size, bool is_write);
+        // lets the prefetcher see a demand access that just completed, and
+        // loads what it asks for
+        VOID observe_access(VOID *addr, VOID *ip, bool hit);
+        VOID prefetch(VOID *addr);
+        VOID output_prefetching(std::ostream *outstream);
+        bool is_sampled(UINT64 index);
+        VOID count_sampled(VOID *addr, bool is_write, bool hit);
+        VOID output_sampling(std::ostream *outstream);
 
     public:
+        // policy is the name of a replacement policy, as taken by
+        // make_replacement_policy()
         Cache(string pdescription = "", Memory *pnext = NULL,
-            int psize = 4*1024, int pways = 1, int pline_len = 8);
+            int psize = 4*1024, int pways = 1, int pline_len = 8,
+            string ppolicy = "fifo");
 
-        virtual UINT64 read(VOID *addr);
-        virtual UINT64 write(VOID *addr);
+        virtual UINT64 read(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        virtual UINT64 write(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
         virtual VOID output(std::ostream *outstream);
+        virtual VOID count_hits(UINT64 read_hits, UINT64 write_hits);
+
+        // Simulates an access to this level alone, without touching the
+        // counters or the next level: returns whether it hit, and on a miss
+        // sets victim to the dirty line that has to be written back (or
+        // ARQSIMUCACHE_NOLINE). Accesses to different sets are independent,
+        // so they can be simulated by different threads. ip and size only
+        // matter if utilization is tracked.
+        bool access_local(VOID *addr, bool is_write, VOID **victim,
+            VOID *ip = NULL, UINT32 size = 1);
+        UINT64 get_set(VOID *addr);
+        VOID count_accesses(UINT64 preads, UINT64 pread_hits, UINT64 pwrites,
+            UINT64 pwrite_hits);
+        VOID count_splits(UINT64 psplits);
+
+        // Simulates only the sets whose address bits selected by mask, once
+        // shifted right by shift, are zero; the caller has to drop the
+        // references to the other sets. The report then extrapolates from
+        // the sampled sets. Returns false if those bits are not all part of
+        // the set index, since then some set would be sampled only partly.
+        bool sample(UINT64 shift, UINT64 mask);
+
+        // Attaches a prefetcher to this level. Prefetched lines are loaded
+        // with next->read(), and don't count as reads of this level.
+        VOID set_prefetcher(Prefetcher *pprefetcher);
+
+        // From now on, counts the misses of each instruction that reaches
+        // this level (accesses made by no known instruction, such as write
+        // backs and prefetches, aren't counted).
+        VOID track_misses_by_ip();
+        // NULL unless misses are tracked
+        AddrMap<ip_misses> *get_misses_by_ip();
+        string get_description();
+        // misses are reported to observer as misses of the given level
+        VOID set_miss_observer(MissObserver *pobserver, UINT32 level);
+
+        // From now on, keeps track of which bytes of each line are used
+        // before it's evicted, and reports how much of the evicted lines
+        // was used, by the instruction that loaded them too.
+        VOID track_utilization();
+        // NULL unless utilization is tracked
+        AddrMap<ip_utilization> *get_utilization_by_ip();
+        UINT64 get_line_len();
+
+        // Makes this level inclusive of upper, the level whose next level
+        // it is (lines evicted here are invalidated in upper too, written
+        // back if they were dirty there), or exclusive of it (this level
+        // only holds the lines upper evicts, and a hit moves the line up).
+        // Levels are non_inclusive unless told otherwise. Returns false for
+        // other modes, and for an exclusive level whose lines aren't as
+        // long as upper's.
+        bool set_inclusion(string mode, Cache *upper);
+
+        // policy is write_back (the default) or write_through; returns false
+        // for other policies
+        bool set_write_policy(string policy, bool allocate);
+        // puts a write buffer of the given number of lines between this
+        // level and the next
+        VOID set_write_buffer(UINT64 entries);
+
+        // lets up to mshrs misses be in flight at once, with a request to
+        // the next level every interval cycles and up to queue_depth
+        // waiting
+        VOID track_misses(UINT64 mshrs, UINT64 interval,
+            UINT64 queue_depth);
+        virtual VOID advance_to(UINT64 now);
 };
 
+// half width of the 95% confidence interval of a ratio estimated from
+// samples (sets, here), given the sum of the numerators and denominators
+// over the samples, the sum of their squares and cross products, and the
+// fraction of the population sampled
+double ratio_confidence(UINT64 samples, double sum_x, double sum_y,
+    double sum_xx, double sum_yy, double sum_xy, double sampled_fraction);
+
+
+//TagStore methods
+TagStore::TagStore(UINT64 nsets, UINT64 nways) : ways(nways),
+    tags(nsets*nways, ARQSIMUCACHE_NOTAG), flags(nsets*nways, 0) {}
 
-//Line methods
-Line::Line(UINT64 ptag) {
-    tag = ptag;
-    dirty = false;
+INT32 TagStore::find(UINT64 index, UINT64 tag) {
+    return find_way(&tags[index*ways], ways, tag);
 }
 
-UINT64 Line::get_tag() {
-    return tag;
+INT32 TagStore::find_free(UINT64 index) {
+    // free ways hold ARQSIMUCACHE_NOTAG, which no line has
+    return find_way(&tags[index*ways], ways, ARQSIMUCACHE_NOTAG);
 }
 
-bool Line::is_dirty() {
-    return dirty;
+VOID TagStore::fill(UINT64 index, UINT32 way, UINT64 tag) {
+    tags[index*ways + way] = tag;
+    flags[index*ways + way] = ARQSIMUCACHE_VALID;
 }
 
-VOID Line::mark_dirty() {
-    dirty = true;
+UINT64 TagStore::get_tag(UINT64 index, UINT32 way) {
+    return tags[index*ways + way];
 }
 
+bool TagStore::is_valid(UINT64 index, UINT32 way) {
+    return flags[index*ways + way] & ARQSIMUCACHE_VALID;
+}
 
-//Set methods
-Set::Set(UINT64 nways) : ways(nways) {}
+bool TagStore::is_dirty(UINT64 index, UINT32 way) {
+    return flags[index*ways + way] & ARQSIMUCACHE_DIRTY;
+}
 
-bool Set::is_present(UINT64 tag) {
-    return (get_line(tag) != NULL);
+VOID TagStore::mark_dirty(UINT64 index, UINT32 way) {
+    flags[index*ways + way] |= ARQSIMUCACHE_DIRTY;
 }
 
-bool Set::is_full() {
-    return (lines.size() == ways);
+bool TagStore::is_prefetched(UINT64 index, UINT32 way) {
+    return flags[index*ways + way] & ARQSIMUCACHE_PREFETCHED;
 }
 
+VOID TagStore::mark_prefetched(UINT64 index, UINT32 way) {
+    flags[index*ways + way] |= ARQSIMUCACHE_PREFETCHED;
+}
+
+VOID TagStore::clear_prefetched(UINT64 index, UINT32 way) {
+    flags[index*ways + way] &= ~ARQSIMUCACHE_PREFETCHED;
+}
 
-Line *Set::get_line(UINT64 tag) {
-    list<Line>::iterator it;
-    for (it = lines.begin(); it != lines.end(); it++) {
-        if (it->get_tag() == tag)
-            return &(*it);
+VOID TagStore::invalidate(UINT64 index, UINT32 way) {
+    tags[index*ways + way] = ARQSIMUCACHE_NOTAG;
+    flags[index*ways + way] = 0;
+}
+
+
+//WriteBuffer methods
+WriteBuffer::WriteBuffer(Memory *pnext, UINT64 entries, UINT64 pline_len) :
+    next(pnext), line_len(pline_len), lines(entries), head(0), count(0),
+    busy_until(0), writes(0), combined(0), stalls(0), stall_cycles(0),
+    forwarded_reads(0), occupancy_sum(0), max_occupancy(0) {}
+
+INT64 WriteBuffer::find(ADDRINT line) {
+    for (UINT64 i = 0; i < count; i++) {
+        if (lines[(head + i) % lines.size()].line == line)
+            return (head + i) % lines.size();
+    }
+    return -1;
+}
+
+VOID WriteBuffer::drain(UINT64 now) {
+    // lines go out back to back, each once the one before is done
+    while (count && busy_until <= now) {
+        entry e = lines[head];
+        head = (head + 1) % lines.size();
+        count--;
+        if (e.victim)
+            busy_until += next->evicted((VOID *)e.line, line_len, true);
+        else
+            busy_until += next->write((VOID *)e.line, NULL, line_len);
     }
-    return NULL;
 }
 
+UINT64 WriteBuffer::write(VOID *addr, UINT64 now, bool victim) {
+    ADDRINT line = (ADDRINT)addr & ~(line_len - 1);
+    drain(now);
+    writes++;
+    occupancy_sum += count;
+    if (count > max_occupancy)
+        max_occupancy = count;
+
+    // a line combined with a victim leaves as the victim it now is
+    INT64 i = find(line);
+    if (i >= 0) {
+        combined++;
+        lines[i].victim |= victim;
+        return 0;
+    }
 
-Line Set::unload_line() {
-    Line unloaded_line = lines.front();
-    lines.pop_front();
-    return unloaded_line;
+    UINT64 stall = 0;
+    if (count == lines.size()) {
+        stalls++;
+        stall = busy_until - now;
+        stall_cycles += stall;
+        drain(busy_until);
+    }
+
+    // an empty buffer starts writing right away
+    if (!count && busy_until < now + stall)
+        busy_until = now + stall;
+    entry e = {line, victim};
+    lines[(head + count) % lines.size()] = e;
+    count++;
+    return stall;
 }
 
-VOID Set::load_line(Line line) {
-    // TODO: handle the case when set is full
-    lines.push_back(line);
+bool WriteBuffer::read(VOID *addr, UINT64 now) {
+    drain(now);
+    if (find((ADDRINT)addr & ~(line_len - 1)) < 0)
+        return false;
+    forwarded_reads++;
+    return true;
 }
 
+VOID WriteBuffer::flush() {
+    while (count)
+        drain(busy_until);
+}
+
+VOID WriteBuffer::output(std::ostream *outstream) {
+    *outstream << "\twrite buffer: " << uint_to_string(lines.size()) <<
+        " lines" << std::endl;
+    *outstream << "\tcombined writes/writes: " << uint_to_string(combined) <<
+        " / " << uint_to_string(writes) << " = " <<
+        double_to_string(combined/(double)writes) << std::endl;
+    *outstream << "\tstalls/writes: " << uint_to_string(stalls) << " / " <<
+        uint_to_string(writes) << " = " <<
+        double_to_string(stalls/(double)writes) << " (" <<
+        uint_to_string(stall_cycles) << " cycles)" << std::endl;
+    *outstream << "\taverage occupancy: " <<
+        double_to_string(occupancy_sum/(double)writes) << " lines (max " <<
+        uint_to_string(max_occupancy) << ")" << std::endl;
+    *outstream << "\treads served by the write buffer: " <<
+        uint_to_string(forwarded_reads) << std::endl;
+}
+
+
+//MissTracker methods
+MissTracker::MissTracker(UINT64 pcapacity, UINT64 pinterval,
+    UINT64 pqueue_depth) : capacity(pcapacity), interval(pinterval),
+    queue_depth(pqueue_depth), link_free(0), misses(0), coalesced(0),
+    mshr_stalls(0), mshr_stall_cycles(0), queue_stalls(0),
+    queue_stall_cycles(0), occupancy_sum(0), max_occupancy(0),
+    queued_sum(0), max_queued(0) {}
+
+VOID MissTracker::retire(UINT64 now) {
+    for (UINT32 i = 0; i < entries.size(); ) {
+        if (entries[i].ready <= now) {
+            entries[i] = entries.back();
+            entries.pop_back();
+        } else {
+            i++;
+        }
+    }
+}
+
+UINT64 MissTracker::queued(UINT64 now) {
+    // requests go out every interval cycles up to link_free, and the ones
+    // after now are still waiting
+    if (link_free <= now)
+        return 0;
+    return (link_free - now + interval - 1)/interval - 1;
+}
+
+UINT64 MissTracker::wait(ADDRINT line, UINT64 now) {
+    for (UINT32 i = 0; i < entries.size(); i++) {
+        if (entries[i].line == line && entries[i].ready > now) {
+            coalesced++;
+            return entries[i].ready - now;
+        }
+    }
+    return 0;
+}
+
+UINT64 MissTracker::allocate(ADDRINT line, UINT64 now, UINT64 *issue) {
+    misses++;
+    UINT64 start = now;
+    retire(now);
+
+    if (entries.size() == capacity) {
+        // until the first miss in flight arrives
+        UINT64 first = entries[0].ready;
+        for (UINT32 i = 1; i < entries.size(); i++) {
+            if (entries[i].ready < first)
+                first = entries[i].ready;
+        }
+        mshr_stalls++;
+        mshr_stall_cycles += first - now;
+        now = first;
+        retire(now);
+    }
+
+    if (queued(now) >= queue_depth && link_free > now) {
+        // until only queue_depth - 1 requests wait
+        UINT64 room = link_free - queue_depth*interval;
+        queue_stalls++;
+        queue_stall_cycles += room - now;
+        now = room;
+    }
+
+    *issue = (link_free > now) ? link_free : now;
+    link_free = *issue + interval;
+    in_flight entry = {line, ~0ULL};
+    entries.push_back(entry);
+
+    // occupancy with this miss in
+    occupancy_sum += entries.size();
+    if (entries.size() > max_occupancy)
+        max_occupancy = entries.size();
+    UINT64 waiting = queued(now);
+    queued_sum += waiting;
+    if (waiting > max_queued)
+        max_queued = waiting;
+    return now - start;
+}
+
+VOID MissTracker::complete(ADDRINT line, UINT64 ready) {
+    for (UINT32 i = entries.size(); i > 0; i--) {
+        if (entries[i - 1].line == line && entries[i - 1].ready == ~0ULL) {
+            entries[i - 1].ready = ready;
+            return;
+        }
+    }
+}
+
+VOID MissTracker::output(std::ostream *outstream) {
+    *outstream << "\tMSHRs: " << uint_to_string(capacity) <<
+        ", a request every " << uint_to_string(interval) <<
+        " cycles, up to " << uint_to_string(queue_depth) << " queued" <<
+        std::endl;
+    *outstream << "\taccesses to lines in flight: " <<
+        uint_to_string(coalesced) << std::endl;
+    *outstream << "\tMSHR stalls/misses: " << uint_to_string(mshr_stalls) <<
+        " / " << uint_to_string(misses) << " = " <<
+        double_to_string(mshr_stalls/(double)misses) << " (" <<
+        uint_to_string(mshr_stall_cycles) << " cycles)" << std::endl;
+    *outstream << "\tqueue stalls/misses: " << uint_to_string(queue_stalls) <<
+        " / " << uint_to_string(misses) << " = " <<
+        double_to_string(queue_stalls/(double)misses) << " (" <<
+        uint_to_string(queue_stall_cycles) << " cycles)" << std::endl;
+    *outstream << "\taverage misses in flight: " <<
+        double_to_string(occupancy_sum/(double)misses) << " (max " <<
+        uint_to_string(max_occupancy) << ")" << std::endl;
+    *outstream << "\taverage requests queued: " <<
+        double_to_string(queued_sum/(double)misses) << " (max " <<
+        uint_to_string(max_queued) << ")" << std::endl;
+}
+
+
 //Memory methods
 Memory::Memory(UINT64 poverhead) : overhead(poverhead) {}
 
-UINT64 Memory::read(VOID *addr) {
+UINT64 Memory::read(VOID *addr, VOID *ip, UINT32 size) {
     return overhead;
 }
 
-UINT64 Memory::write(VOID *addr) {
+UINT64 Memory::write(VOID *addr, VOID *ip, UINT32 size) {
     return overhead;
 }
 
+UINT64 Memory::evicted(VOID *addr, UINT32 size, bool dirty) {
+    return dirty ? write(addr, NULL, size) : 0;
+}
+
+VOID Memory::advance_to(UINT64 now) {}
+
+bool Memory::takes_evicted() {
+    return false;
+}
+
+VOID Memory::count_hits(UINT64 read_hits, UINT64 write_hits) {}
+
 VOID Memory::set_overhead(UINT64 new_overhead) {
     overhead = new_overhead;
 }
@@ -155,16 +717,24 @@ VOID RAM::output(std::ostream *outstream) {}
 
 
 //Cache methods
+UINT64 cache_overhead(string description) {
+    if (description == "L1")
+        return ARQSIMUCACHE_L1OH;
+    else if (description == "L2")
+        return ARQSIMUCACHE_L2OH;
+    return 0;
+}
+
 UINT64 Cache::index_len() {
-    return log2(size/(ways*line_len));
+    return index_bits;
 }
 
 UINT64 Cache::index_mask() {
-    return 0xFFFFFFFFFFFFFFFF >> (64 - index_len());
+    return index_bitmask;
 }
 
 UINT64 Cache::offset_len() {
-    return log2(line_len);
+    return offset_bits;
 }
 
 VOID* Cache::make_addr(UINT64 tag, UINT64 index) {
@@ -182,75 +752,738 @@ UINT64 Cache::get_tag(VOID *addr) {
 }
 
 Cache::Cache(string pdescription, Memory *pnext,
-    int psize, int pways, int pline_len) :
-    description(pdescription), next(pnext), ways(pways),
-    line_len(pline_len), size(psize) {
+    int psize, int pways, int pline_len, string ppolicy) :
+    description(pdescription), next(pnext),
+    lines(psize/(pways*pline_len), pways), ways(pways), line_len(pline_len),
+    size(psize), reads(0), writes(0), read_hits(0), write_hits(0), splits(0),
+    sample_shift(0), sample_mask(0), clock(0), prefetcher(NULL),
+    prefetches(0), useful_prefetches(0), late_prefetches(0),
+    pollution_evictions(0), misses_by_ip(NULL), observer(NULL),
+    observer_level(0), chunk_len(1), chunks(0), utilization_by_ip(NULL),
+    inclusion("non_inclusive"), inclusive_upper(NULL), exclusive_lower(NULL),
+    keep_clean_victims(pnext && pnext->takes_evicted()),
+    clean_victim(ARQSIMUCACHE_NOLINE), back_invalidations(0),
+    dirty_back_invalidations(0), victim_fills(0), moves_up(0),
+    write_through(false), write_allocate(true), write_buffer(NULL),
+    writes_forwarded(0), miss_tracker(NULL) {
 
-    UINT64 my_overhead = 0;
-    if (description == "L1")
-        my_overhead = ARQSIMUCACHE_L1OH;
-    else if (description == "L2")
-        my_overhead = ARQSIMUCACHE_L2OH;
-    set_overhead(my_overhead);
+    set_overhead(cache_overhead(description));
 
-    int sets_number = size/(ways*line_len);
-     
-    for (int i = 0; i < sets_number; i++)
-        sets.push_back(Set(ways));
+    offset_bits = log2(line_len);
+    index_bits = log2(size/(ways*line_len));
+    index_bitmask = (1ULL << index_bits) - 1;
 
+    policy = make_replacement_policy(ppolicy, index_bitmask + 1, ways);
+    if (!policy)
+        policy = new FifoPolicy(index_bitmask + 1, ways);
 }
 
-UINT64 Cache::read(VOID *addr) {
+bool Cache::access_local(VOID *addr, bool is_write, VOID **victim,
+    VOID *ip, UINT32 size) {
+    UINT64 tag = get_tag(addr), index = get_index(addr);
+    *victim = ARQSIMUCACHE_NOLINE;
+
+    INT32 way = lines.find(index, tag);
+    bool hit = (way >= 0);
+    if (hit) {
+        policy->touch(index, way);
+    } else {
+        way = lines.find_free(index);
+        if (way < 0)
+            way = policy->victim(index);
+        *victim = evict(index, way);
+        if (chunks) {
+            loaded_by[index*ways + way] = (ADDRINT)ip;
+            used_chunks[index*ways + way] = 0;
+        }
+        lines.fill(index, way, tag);
+        policy->insert(index, way);
+    }
+
+    if (is_write)
+        lines.mark_dirty(index, way);
+    if (chunks)
+        use_bytes(index, way, addr, size);
+    return hit;
+}
+
+VOID *Cache::line_addr(VOID *addr) {
+    return (VOID *)((UINT64)addr & ~(UINT64)(line_len - 1));
+}
+
+VOID *Cache::evict(UINT64 index, UINT32 way) {
+    if (keep_clean_victims)
+        clean_victim = ARQSIMUCACHE_NOLINE;
+    if (!lines.is_valid(index, way))
+        return ARQSIMUCACHE_NOLINE;
+
+    VOID *line = make_addr(lines.get_tag(index, way), index);
+    bool dirty = lines.is_dirty(index, way);
+    if (chunks)
+        count_eviction(index, way);
+
+    if (inclusive_upper) {
+        UINT64 upper_dirty = 0;
+        back_invalidations += inclusive_upper->invalidate(line, line_len,
+            &upper_dirty);
+        dirty_back_invalidations += upper_dirty;
+        dirty |= (upper_dirty > 0);
+    }
+
+    if (dirty)
+        return line;
+    if (keep_clean_victims)
+        clean_victim = line;
+    return ARQSIMUCACHE_NOLINE;
+}
+
+UINT32 Cache::invalidate(VOID *addr, UINT64 len, UINT64 *dirty_lines) {
+    UINT32 invalidated = 0;
+    UINT64 end = (UINT64)addr + len;
+    for (UINT64 line = (UINT64)line_addr(addr); line < end;
+        line += line_len) {
+        UINT64 index = get_index((VOID *)line);
+        INT32 way = lines.find(index, get_tag((VOID *)line));
+        if (way < 0)
+            continue;
+
+        if (chunks)
+            count_eviction(index, way);
+        *dirty_lines += lines.is_dirty(index, way);
+        lines.invalidate(index, way);
+        invalidated++;
+    }
+    return invalidated;
+}
+
+UINT64 Cache::insert_victim(VOID *addr, bool dirty) {
+    victim_fills++;
+    UINT64 tag = get_tag(addr), index = get_index(addr);
+
+    // a prefetch of this level may have loaded the line already
+    INT32 way = lines.find(index, tag);
+    UINT64 total_overhead = get_overhead();
+    if (way < 0) {
+        way = lines.find_free(index);
+        if (way < 0)
+            way = policy->victim(index);
+        VOID *victim = evict(index, way);
+        if (victim != ARQSIMUCACHE_NOLINE)
+            total_overhead += write_back(victim);
+        else if (clean_victim != ARQSIMUCACHE_NOLINE)
+            total_overhead += next->evicted(clean_victim, line_len, false);
+
+        lines.fill(index, way, tag);
+        policy->insert(index, way);
+        if (chunks) {
+            loaded_by[index*ways + way] = 0;
+            used_chunks[index*ways + way] = 0;
+        }
+    }
+
+    if (dirty)
+        lines.mark_dirty(index, way);
+    return total_overhead;
+}
+
+UINT64 Cache::move_up(VOID *addr, VOID *ip, bool *dirty) {
     reads++;
     UINT64 tag = get_tag(addr), index = get_index(addr);
 
-    UINT64 total_overhead = 0;
-    if (sets[index].is_present(tag)) {
+    bool hit = (lines.find(index, tag) >= 0);
+    UINT64 total_overhead = get_overhead();
+    if (hit) {
         read_hits++;
+        moves_up++;
     } else {
-        if (sets[index].is_full()) {
-            Line line = sets[index].unload_line();
-            if (line.is_dirty()) {
-                total_overhead +=
-                    next->write(make_addr(line.get_tag(), index));
-            }
+        total_overhead += read_next(addr, ip, line_len);
+        if (misses_by_ip || observer)
+            count_miss(ip, addr, false);
+    }
+
+    clock += total_overhead;
+    if (prefetcher)
+        observe_access(addr, ip, hit);
+
+    // the line leaves once the prefetcher has seen the hit; a prefetch may
+    // have replaced it in the meantime, writing it back
+    *dirty = false;
+    INT32 way = lines.find(index, tag);
+    if (hit && way >= 0) {
+        *dirty = lines.is_dirty(index, way);
+        if (chunks) {
+            use_bytes(index, way, addr, line_len);
+            count_eviction(index, way);
         }
-        
-        total_overhead += next->read(addr);
-        sets[index].load_line(Line(tag));
+        lines.invalidate(index, way);
+    }
+    return total_overhead;
+}
+
+bool Cache::set_inclusion(string mode, Cache *upper) {
+    if (mode == "inclusive") {
+        inclusive_upper = upper;
+    } else if (mode == "exclusive") {
+        if (upper->line_len != line_len)
+            return false;
+        upper->exclusive_lower = this;
+        upper->keep_clean_victims = true;
+    } else if (mode != "non_inclusive") {
+        return false;
     }
+    inclusion = mode;
+    return true;
+}
+
+bool Cache::set_write_policy(string policy, bool allocate) {
+    if (policy != "write_back" && policy != "write_through")
+        return false;
+    write_through = (policy == "write_through");
+    write_allocate = allocate;
+    return true;
+}
+
+VOID Cache::set_write_buffer(UINT64 entries) {
+    write_buffer = new WriteBuffer(next, entries, line_len);
+}
+
+VOID Cache::track_misses(UINT64 mshrs, UINT64 interval,
+    UINT64 queue_depth) {
+    miss_tracker = new MissTracker(mshrs, interval, queue_depth);
+}
+
+VOID Cache::advance_to(UINT64 now) {
+    if (miss_tracker && now > clock)
+        clock = now;
+}
+
+UINT64 Cache::send_miss(VOID *addr, VOID *victim, VOID *ip,
+    UINT64 *stall) {
+    *stall = 0;
+    if (!miss_tracker) {
+        next->advance_to(clock);
+        return forward_miss(addr, victim, ip);
+    }
+
+    ADDRINT line = (ADDRINT)line_addr(addr);
+    UINT64 issue;
+    *stall = miss_tracker->allocate(line, clock, &issue);
+    next->advance_to(issue);
+    UINT64 latency = forward_miss(addr, victim, ip);
+    miss_tracker->complete(line, issue + latency);
+    return issue - clock + latency;
+}
+
+UINT64 Cache::forward_miss(VOID *addr, VOID *victim, VOID *ip) {
+    UINT64 total_overhead = 0;
+
+    if (exclusive_lower) {
+        // the line is taken from the level below before the victim takes
+        // its place there, since it may be in the same set
+        bool dirty;
+        total_overhead += exclusive_lower->move_up(line_addr(addr), ip,
+            &dirty);
+        if (dirty) {
+            UINT64 index = get_index(addr);
+            lines.mark_dirty(index, lines.find(index, get_tag(addr)));
+        }
+
+        if (victim != ARQSIMUCACHE_NOLINE)
+            total_overhead += exclusive_lower->insert_victim(victim, true);
+        else if (clean_victim != ARQSIMUCACHE_NOLINE)
+            total_overhead += exclusive_lower->insert_victim(clean_victim,
+                false);
+        return total_overhead;
+    }
+
+    // the next level is asked for whole lines, and gets the victims once
+    // it gave the line, so that a victim cache swaps them instead of
+    // replacing the line that is missing
+    total_overhead += read_next(line_addr(addr), ip, line_len);
+    if (victim != ARQSIMUCACHE_NOLINE)
+        total_overhead += write_back(victim);
+    else if (clean_victim != ARQSIMUCACHE_NOLINE)
+        total_overhead += next->evicted(clean_victim, line_len, false);
+    return total_overhead;
+}
+
+UINT64 Cache::write_next(VOID *addr, VOID *ip, UINT32 size) {
+    if (write_buffer)
+        return write_buffer->write(addr, clock);
+    return next->write(addr, ip, size);
+}
+
+UINT64 Cache::write_back(VOID *victim) {
+    if (write_buffer)
+        return write_buffer->write(victim, clock, true);
+    return next->evicted(victim, line_len, true);
+}
+
+UINT64 Cache::read_next(VOID *addr, VOID *ip, UINT32 size) {
+    if (write_buffer && write_buffer->read(addr, clock))
+        return 0;
+    return next->read(addr, ip, size);
+}
+
+bool Cache::hit_local(VOID *addr, bool is_write, UINT32 size) {
+    UINT64 tag = get_tag(addr), index = get_index(addr);
+    INT32 way = lines.find(index, tag);
+    if (way < 0)
+        return false;
+
+    policy->touch(index, way);
+    if (is_write)
+        lines.mark_dirty(index, way);
+    if (chunks)
+        use_bytes(index, way, addr, size);
+    return true;
+}
+
+UINT64 Cache::read(VOID *addr, VOID *ip, UINT32 size) {
+    if (crosses_line(addr, size, line_len))
+        return split_access(addr, ip, size, false);
+    return read_line(addr, ip, size);
+}
+
+UINT64 Cache::write(VOID *addr, VOID *ip, UINT32 size) {
+    if (crosses_line(addr, size, line_len))
+        return split_access(addr, ip, size, true);
+    return write_line(addr, ip, size);
+}
+
+UINT64 Cache::split_access(VOID *addr, VOID *ip, UINT32 size,
+    bool is_write) {
+    splits++;
+
+    UINT64 total_overhead = 0;
+    UINT64 start = (UINT64)addr, end = start + size;
+    while (start < end) {
+        UINT64 line_end = (start | (line_len - 1)) + 1;
+        UINT32 len = (line_end < end ? line_end : end) - start;
+
+        // with set sampling, the lines in other sets are dropped like the
+        // tool drops whole accesses
+        if (sampled_counts.empty() || is_sampled(get_index((VOID *)start))) {
+            if (is_write)
+                total_overhead += write_line((VOID *)start, ip, len);
+            else
+                total_overhead += read_line((VOID *)start, ip, len);
+        }
+        start = line_end;
+    }
+    return total_overhead;
+}
+
+UINT64 Cache::read_line(VOID *addr, VOID *ip, UINT32 size) {
+    reads++;
+
+    VOID *victim;
+    UINT64 total_overhead = 0, stall = 0;
+    bool hit = access_local(addr, false, &victim, ip, size);
+    if (hit) {
+        read_hits++;
+        if (miss_tracker)
+            total_overhead += miss_tracker->wait(
+                (ADDRINT)line_addr(addr), clock);
+    } else {
+        total_overhead += send_miss(addr, victim, ip, &stall);
+        if (misses_by_ip || observer)
+            count_miss(ip, addr, false);
+    }
+    if (!sampled_counts.empty())
+        count_sampled(addr, false, hit);
 
     total_overhead += get_overhead();
+    // levels that track their misses go on while they're in flight
+    clock += miss_tracker ? get_overhead() + stall : total_overhead;
+    if (prefetcher)
+        observe_access(addr, ip, hit);
     return total_overhead;
 }
 
-UINT64 Cache::write(VOID *addr) {
+UINT64 Cache::write_line(VOID *addr, VOID *ip, UINT32 size) {
     writes++;
-    UINT64 tag = get_tag(addr), index = get_index(addr);        
-    
-    UINT64 total_overhead = 0;
-    if (sets[index].is_present(tag)) {
-        write_hits++;
+
+    // written lines are only dirty in write back caches
+    VOID *victim;
+    UINT64 total_overhead = 0, stall = 0;
+    bool hit;
+    if (write_allocate) {
+        hit = access_local(addr, !write_through, &victim, ip, size);
+        if (!hit)
+            total_overhead += send_miss(addr, victim, ip, &stall);
     } else {
-        if (sets[index].is_full()) {
-            Line line = sets[index].unload_line();
-            if (line.is_dirty()) {
-                total_overhead +=
-                    next->write(make_addr(line.get_tag(), index));
-            }
-        }
-        
-        total_overhead += next->read(addr);
-        sets[index].load_line(Line(tag));
+        hit = hit_local(addr, !write_through, size);
     }
+    if (hit && miss_tracker)
+        total_overhead += miss_tracker->wait((ADDRINT)line_addr(addr),
+            clock);
 
-    sets[index].get_line(tag)->mark_dirty();
+    if (hit)
+        write_hits++;
+    else if (misses_by_ip || observer)
+        count_miss(ip, addr, true);
+    if (write_through || (!hit && !write_allocate)) {
+        writes_forwarded++;
+        total_overhead += write_next(addr, ip, size);
+    }
+    if (!sampled_counts.empty())
+        count_sampled(addr, true, hit);
 
     total_overhead += get_overhead();
+    clock += miss_tracker ? get_overhead() + stall : total_overhead;
+    if (prefetcher)
+        observe_access(addr, ip, hit);
     return total_overhead;
 }
 
+VOID Cache::track_misses_by_ip() {
+    misses_by_ip = new AddrMap<ip_misses>(4096);
+}
+
+AddrMap<ip_misses> *Cache::get_misses_by_ip() {
+    return misses_by_ip;
+}
+
+string Cache::get_description() {
+    return description;
+}
+
+VOID Cache::set_miss_observer(MissObserver *pobserver, UINT32 level) {
+    observer = pobserver;
+    observer_level = level;
+}
+
+VOID Cache::count_miss(VOID *ip, VOID *addr, bool is_write) {
+    if (observer)
+        observer->miss(observer_level, ip, addr, is_write);
+
+    if (!misses_by_ip || !ip)
+        return;
+
+    ip_misses *misses = misses_by_ip->get((UINT64)ip);
+    if (is_write)
+        misses->writes++;
+    else
+        misses->reads++;
+}
+
+VOID Cache::track_utilization() {
+    // up to 64 chunks, one bit each
+    chunk_len = line_len > 64 ? line_len/64 : 1;
+    chunks = line_len/chunk_len;
+    used_chunks.assign((index_mask() + 1)*ways, 0);
+    loaded_by.assign((index_mask() + 1)*ways, 0);
+    for (UINT32 i = 0; i < ARQSIMUCACHE_UTIL_BUCKETS; i++)
+        utilization_counts[i] = 0;
+    utilization_by_ip = new AddrMap<ip_utilization>(4096);
+}
+
+AddrMap<ip_utilization> *Cache::get_utilization_by_ip() {
+    return utilization_by_ip;
+}
+
+UINT64 Cache::get_line_len() {
+    return line_len;
+}
+
+VOID Cache::use_bytes(UINT64 index, UINT32 way, VOID *addr, UINT32 size) {
+    // only the bytes of the access that fall in this line
+    UINT64 offset = (UINT64)addr & (line_len - 1);
+    UINT64 end = offset + (size ? size : 1);
+    if (end > (UINT64)line_len)
+        end = line_len;
+
+    UINT64 first = offset/chunk_len, last = (end - 1)/chunk_len;
+    UINT64 mask = (last - first == 63) ? ~0ULL :
+        ((1ULL << (last - first + 1)) - 1) << first;
+    used_chunks[index*ways + way] |= mask;
+}
+
+VOID Cache::count_eviction(UINT64 index, UINT32 way) {
+    UINT64 used = 0;
+    for (UINT64 mask = used_chunks[index*ways + way]; mask; mask &= mask - 1)
+        used++;
+
+    UINT64 bucket = (used*(ARQSIMUCACHE_UTIL_BUCKETS - 1) + chunks - 1)/chunks;
+    utilization_counts[bucket]++;
+
+    // lines loaded by prefetches or write backs have no instruction
+    ADDRINT ip = loaded_by[index*ways + way];
+    if (!ip)
+        return;
+    ip_utilization *utilization = utilization_by_ip->get(ip);
+    utilization->lines++;
+    utilization->used_bytes += used*chunk_len;
+}
+
+VOID Cache::output_utilization(std::ostream *outstream) {
+    UINT64 evictions = 0;
+    for (UINT32 i = 0; i < ARQSIMUCACHE_UTIL_BUCKETS; i++)
+        evictions += utilization_counts[i];
+
+    *outstream << "\tevicted lines by bytes used (in eighths of " <<
+        uint_to_string(line_len) << " bytes):" << std::endl;
+    for (UINT32 i = 0; i < ARQSIMUCACHE_UTIL_BUCKETS; i++) {
+        *outstream << "\t\t" << (i ? "up to " + uint_to_string(i) + "/" +
+            uint_to_string(ARQSIMUCACHE_UTIL_BUCKETS - 1) : "none") <<
+            ": " << uint_to_string(utilization_counts[i]) << " / " <<
+            uint_to_string(evictions) << " = " <<
+            double_to_string(utilization_counts[i]/(double)evictions) <<
+            std::endl;
+    }
+}
+
+VOID Cache::set_prefetcher(Prefetcher *pprefetcher) {
+    prefetcher = pprefetcher;
+    ready_at.assign((index_mask() + 1)*ways, 0);
+}
+
+VOID Cache::observe_access(VOID *addr, VOID *ip, bool hit) {
+    UINT64 tag = get_tag(addr), index = get_index(addr);
+    INT32 way = lines.find(index, tag);
+    UINT64 line = (UINT64)addr >> offset_len();
+
+    bool prefetch_hit = false;
+    if (hit && lines.is_prefetched(index, way)) {
+        // the first use of a prefetched line; if the line would still have
+        // been on its way, the prefetch only hid part of the miss
+        prefetch_hit = true;
+        useful_prefetches++;
+        if (clock < ready_at[index*ways + way])
+            late_prefetches++;
+        lines.clear_prefetched(index, way);
+    } else if (!hit) {
+        UINT8 *evicted = evicted_by_prefetch.find(line);
+        if (evicted && *evicted) {
+            pollution_evictions++;
+            *evicted = 0;
+        }
+    }
+
+    VOID *addrs[ARQSIMUPREFETCH_MAX_DEGREE];
+    UINT32 n = prefetcher->observe(ip, addr, !hit, prefetch_hit, addrs);
+    for (UINT32 i = 0; i < n; i++)
+        prefetch(addrs[i]);
+}
+
+VOID Cache::prefetch(VOID *addr) {
+    UINT64 tag = get_tag(addr), index = get_index(addr);
+    if (lines.find(index, tag) >= 0)
+        return;
+    prefetches++;
+
+    INT32 way = lines.find_free(index);
+    if (way < 0)
+        way = policy->victim(index);
+
+    if (lines.is_valid(index, way)) {
+        // if the demand misses on it later, the prefetch polluted the cache
+        UINT8 *evicted = evicted_by_prefetch.get(
+            (UINT64)make_addr(lines.get_tag(index, way), index) >>
+            offset_len());
+        *evicted = 1;
+    }
+    VOID *victim = evict(index, way);
+
+    UINT8 *evicted = evicted_by_prefetch.find((UINT64)addr >> offset_len());
+    if (evicted)
+        *evicted = 0;
+
+    // filled first, so that a line taken from an exclusive level below can
+    // be marked dirty
+    lines.fill(index, way, tag);
+    lines.mark_prefetched(index, way);
+    policy->insert(index, way);
+    if (chunks) {
+        loaded_by[index*ways + way] = 0;
+        used_chunks[index*ways + way] = 0;
+    }
+    // prefetches take an MSHR and a request like demand misses do, but the
+    // level doesn't stall for them
+    UINT64 stall;
+    ready_at[index*ways + way] = clock + send_miss(addr, victim, NULL,
+        &stall);
+}
+
+UINT64 Cache::get_set(VOID *addr) {
+    return get_index(addr);
+}
+
+VOID Cache::count_accesses(UINT64 preads, UINT64 pread_hits, UINT64 pwrites,
+    UINT64 pwrite_hits) {
+    reads += preads;
+    read_hits += pread_hits;
+    writes += pwrites;
+    write_hits += pwrite_hits;
+}
+
+VOID Cache::count_splits(UINT64 psplits) {
+    splits += psplits;
+}
+
+VOID Cache::count_hits(UINT64 pread_hits, UINT64 pwrite_hits) {
+    count_accesses(pread_hits, pread_hits, pwrite_hits, pwrite_hits);
+}
+
+bool Cache::sample(UINT64 shift, UINT64 mask) {
+    if (shift < offset_len() ||
+        (mask << shift) >> offset_len() > index_mask())
+        return false;
+
+    sample_shift = shift;
+    sample_mask = mask;
+    set_counts zero = {0, 0, 0, 0};
+    sampled_counts.assign(index_mask() + 1, zero);
+    return true;
+}
+
+bool Cache::is_sampled(UINT64 index) {
+    return !(((UINT64)make_addr(0, index) >> sample_shift) & sample_mask);
+}
+
+VOID Cache::count_sampled(VOID *addr, bool is_write, bool hit) {
+    set_counts *counts = &sampled_counts[get_index(addr)];
+    if (is_write) {
+        counts->writes++;
+        counts->write_hits += hit;
+    } else {
+        counts->reads++;
+        counts->read_hits += hit;
+    }
+}
+
+VOID Cache::output_sampling(std::ostream *outstream) {
+    UINT64 samples = 0;
+    double sum_reads = 0, sum_reads2 = 0, sum_read_hits = 0,
+        sum_read_hits2 = 0, sum_reads_hits = 0;
+    double sum_writes = 0, sum_writes2 = 0, sum_write_hits = 0,
+        sum_write_hits2 = 0, sum_writes_hits = 0;
+
+    for (UINT64 i = 0; i < sampled_counts.size(); i++) {
+        if (!is_sampled(i))
+            continue;
+        samples++;
+
+        set_counts *counts = &sampled_counts[i];
+        sum_reads += counts->reads;
+        sum_reads2 += counts->reads*(double)counts->reads;
+        sum_read_hits += counts->read_hits;
+        sum_read_hits2 += counts->read_hits*(double)counts->read_hits;
+        sum_reads_hits += counts->reads*(double)counts->read_hits;
+        sum_writes += counts->writes;
+        sum_writes2 += counts->writes*(double)counts->writes;
+        sum_write_hits += counts->write_hits;
+        sum_write_hits2 += counts->write_hits*(double)counts->write_hits;
+        sum_writes_hits += counts->writes*(double)counts->write_hits;
+    }
+
+    UINT64 sets = sampled_counts.size();
+    double fraction = samples/(double)sets;
+
+    *outstream << "\tsampled sets/sets: " << uint_to_string(samples) <<
+        " / " << uint_to_string(sets) << " = " << double_to_string(fraction) <<
+        std::endl;
+    *outstream << "\testimated reads: " <<
+        uint_to_string((UINT64)(reads/fraction)) << std::endl;
+    *outstream << "\tread hit ratio 95% confidence interval: " <<
+        double_to_string(read_hits/(double)reads) << " +- " <<
+        double_to_string(ratio_confidence(samples, sum_read_hits, sum_reads,
+            sum_read_hits2, sum_reads2, sum_reads_hits, fraction)) <<
+        std::endl;
+    *outstream << "\testimated writes: " <<
+        uint_to_string((UINT64)(writes/fraction)) << std::endl;
+    *outstream << "\twrite hit ratio 95% confidence interval: " <<
+        double_to_string(write_hits/(double)writes) << " +- " <<
+        double_to_string(ratio_confidence(samples, sum_write_hits,
+            sum_writes, sum_write_hits2, sum_writes2, sum_writes_hits,
+            fraction)) << std::endl;
+}
+
+VOID Cache::output_write_policy(std::ostream *outstream) {
+    *outstream << "\twrite policy: " <<
+        (write_through ? "write through, " : "write back, ") <<
+        (write_allocate ? "write allocate" : "no write allocate") <<
+        std::endl;
+    *outstream << "\twrites sent on to the next level: " <<
+        uint_to_string(writes_forwarded) << std::endl;
+    if (write_buffer)
+        write_buffer->output(outstream);
+}
+
+VOID Cache::output_inclusion(std::ostream *outstream) {
+    *outstream << "\tinclusion: " << inclusion << std::endl;
+    if (inclusive_upper) {
+        *outstream << "\tback invalidations (dirty lines): " <<
+            uint_to_string(back_invalidations) << " (" <<
+            uint_to_string(dirty_back_invalidations) << ")" << std::endl;
+    } else {
+        *outstream << "\tlines filled by upper level evictions: " <<
+            uint_to_string(victim_fills) << std::endl;
+        *outstream << "\tlines moved up to the upper level: " <<
+            uint_to_string(moves_up) << std::endl;
+    }
+}
+
+VOID Cache::output_prefetching(std::ostream *outstream) {
+    *outstream << "\tprefetcher: " << prefetcher->get_name() << ", degree " <<
+        uint_to_string(prefetcher->get_degree()) << std::endl;
+    *outstream << "\tprefetches issued: " << uint_to_string(prefetches) <<
+        std::endl;
+    *outstream << "\tuseful prefetches/prefetches: " <<
+        uint_to_string(useful_prefetches) << " / " <<
+        uint_to_string(prefetches) << " = " <<
+        double_to_string(useful_prefetches/(double)prefetches) << std::endl;
+    *outstream << "\tlate prefetches/useful prefetches: " <<
+        uint_to_string(late_prefetches) << " / " <<
+        uint_to_string(useful_prefetches) << " = " <<
+        double_to_string(late_prefetches/(double)useful_prefetches) <<
+        std::endl;
+    *outstream << "\tpollution evictions: " <<
+        uint_to_string(pollution_evictions) << std::endl;
+}
+
 VOID Cache::output(std::ostream *outstream) {
+    // the lines left in the write buffer count at the next level, which
+    // reports after this one
+    if (write_buffer)
+        write_buffer->flush();
+    output_cache_stats(outstream, description, reads, read_hits, writes,
+        write_hits, splits, policy->get_name());
+    if (prefetcher)
+        output_prefetching(outstream);
+    if (chunks)
+        output_utilization(outstream);
+    if (inclusion != "non_inclusive")
+        output_inclusion(outstream);
+    if (write_through || !write_allocate || write_buffer)
+        output_write_policy(outstream);
+    if (miss_tracker)
+        miss_tracker->output(outstream);
+    if (!sampled_counts.empty())
+        output_sampling(outstream);
+    next->output(outstream);
+}
+
+double ratio_confidence(UINT64 samples, double sum_x, double sum_y,
+    double sum_xx, double sum_yy, double sum_xy, double sampled_fraction) {
+    if (samples < 2 || !sum_y)
+        return 0;
+
+    // variance of the ratio estimator r = sum_x/sum_y, from the residuals
+    // x - r*y of every sample, with the finite population correction
+    double r = sum_x/sum_y;
+    double residuals = sum_xx - 2*r*sum_xy + r*r*sum_yy;
+    double mean_y = sum_y/samples;
+    double variance = (1 - sampled_fraction)*residuals/(samples - 1)/
+        (samples*mean_y*mean_y);
+
+    return 1.96*sqrt(variance > 0 ? variance : 0);
+}
+
+VOID output_cache_stats(std::ostream *outstream, string description,
+    UINT64 reads, UINT64 read_hits, UINT64 writes, UINT64 write_hits,
+    UINT64 splits, string policy) {
     *outstream << "=====" << std::endl;
     *outstream << description << ":" << std::endl;
 
@@ -263,5 +1496,15 @@ VOID Cache::output(std::ostream *outstream) {
         uint_to_string(write_hits) << " / " <<
         uint_to_string(writes) << " = " <<
         double_to_string(write_hits/(double)writes) << std::endl;
-    next->output(outstream);
+
+    *outstream << "\taccesses split across lines: " <<
+        uint_to_string(splits) << std::endl;
+
+    *outstream << "\treplacement policy: " << policy << std::endl;
+}
+
+bool crosses_line(VOID *addr, UINT32 size, UINT64 line_len) {
+    return ((UINT64)addr & (line_len - 1)) + size > line_len;
 }
+
+#endif
@@ -0,0 +1,617 @@
+#ifndef __ARQSIMUCOHERENCE_HPP__
+#define __ARQSIMUCOHERENCE_HPP__
+
+#include <string.h>
+#include "arqsimucache.hpp"
+#include "arqsimusharing.hpp"
+
+// private caches the directory tells apart, one bit each; threads whose
+// ids are equal modulo this share one, as if they ran on the same core
+#define ARQSIMUCOHERENCE_MAX_CORES 64
+// locks the directory and the shared level are split into (a power of 2)
+#define ARQSIMUCOHERENCE_STRIPES 256
+
+// MESI states of the lines of a private cache
+#define ARQSIMUCOHERENCE_INVALID 0
+#define ARQSIMUCOHERENCE_SHARED 1
+#define ARQSIMUCOHERENCE_EXCLUSIVE 2
+#define ARQSIMUCOHERENCE_MODIFIED 3
+
+// Lock that spins (yielding) while it's taken, in a host cache line of its
+// own
+struct spin_lock {
+    volatile UINT32 taken;
+    UINT8 padding[60];
+};
+
+VOID init_lock(spin_lock *lock);
+VOID acquire_lock(spin_lock *lock);
+VOID release_lock(spin_lock *lock);
+
+// What happened to the lines of a private cache
+struct core_counts {
+    // references, and line accesses as in Cache
+    UINT64 accesses, reads, read_hits, writes, write_hits, splits;
+    // lines other cores took away (invalidations) or made it share after
+    // it held them exclusive (interventions), lines it took away from
+    // other cores, and writes to shared lines it had to make exclusive
+    UINT64 invalidations, interventions, invalidations_sent, upgrades;
+    // misses on lines another core had taken away
+    UINT64 coherence_misses;
+};
+
+// The private L1 of a core. The lines it holds are ADDRINT line numbers
+// (addresses shifted right by the line offset), each in a MESI state. It's
+// only touched with its lock held: by its own threads, and by the
+// directory when other cores need its lines.
+class PrivateCache {
+    private:
+        spin_lock lock;
+        UINT32 id;
+        // ids of the threads that use it
+        vector<THREADID> threads;
+        TagStore lines;
+        ReplacementPolicy *policy;
+        vector<UINT8> states;
+        // chunks of each line written since it was last modified, for the
+        // sharing detector
+        vector<UINT64> written;
+        UINT64 ways, index_len, index_mask;
+        core_counts counts;
+
+        // state of line, ARQSIMUCOHERENCE_INVALID if it's not here; sets
+        // index and way to where it is
+        UINT8 find(ADDRINT line, UINT64 *index, INT32 *way);
+        VOID touch(UINT64 index, UINT32 way);
+        VOID set_state(UINT64 index, UINT32 way, UINT8 state);
+        VOID add_written(UINT64 index, UINT32 way, UINT64 chunks);
+        // loads line in state, with chunks written, and returns the line it
+        // replaced (or ARQSIMUHASH_EMPTY), setting victim_state to what it
+        // was in and victim_written to its chunks written
+        ADDRINT fill(ADDRINT line, UINT8 state, UINT64 chunks,
+            UINT8 *victim_state, UINT64 *victim_written);
+        // takes line down to state (shared or invalid), if it's here in a
+        // higher one, and returns the state it was in; sets old_written to the
+        // chunks it had written, which no longer count
+        UINT8 demote(ADDRINT line, UINT8 state, UINT64 *old_written);
+
+        friend class CoherentHierarchy;
+
+    public:
+        PrivateCache(UINT32 pid, UINT64 size = 32*1024, UINT64 pways = 8,
+            UINT64 line_len = 64, string policy_name = "lru");
+
+        UINT32 get_id();
+};
+
+// Private L1s, one per core, over a shared L2 that keeps them coherent with
+// MESI through a directory. The directory knows which cores hold each L1
+// line, and whether one of them holds it exclusive (E or M).
+//
+// Hits that need no other core (reads of valid lines, writes to E and M
+// lines) only take the lock of the core's own L1. Misses and writes to
+// shared lines go to the directory, which is split in stripes by L2 set:
+// a stripe's lock covers the directory entries of its lines and its L2
+// sets, so accesses to different stripes run in parallel. A transaction
+// holds its stripe's lock, and takes the locks of the L1s involved in the
+// order of their ids, so transactions never wait for each other in a cycle.
+//
+// Read misses get the line from the core that holds it exclusive, if any
+// (an intervention: the line is written back to L2 if it was modified, and
+// both keep it shared), or from L2, exclusive if no other core has it.
+// Write misses and writes to shared lines (upgrades) invalidate every other
+// copy, and the line ends up modified. L1 victims are written back to L2 if
+// they were modified, and taken out of the directory, once the transaction
+// that replaced them is over.
+//
+// L2 lines must be at least as long as L1 lines. Memory below L2 keeps no
+// state, so L2 misses aren't simulated any further.
+class CoherentHierarchy {
+    private:
+        struct directory_entry {
+            // cores that hold the line, and cores it was taken away from
+            // since they last loaded it
+            UINT64 sharers, invalidated;
+            // whether the only sharer holds it exclusive
+            bool exclusive;
+        };
+        struct stripe {
+            spin_lock lock;
+            AddrMap<directory_entry> entries;
+            UINT64 l2_reads, l2_read_hits, l2_writes, l2_write_hits;
+            stripe();
+        };
+
+        Cache *l2;
+        UINT64 size, ways, line_len, offset_len;
+        string policy_name;
+        PrivateCache *cores[ARQSIMUCOHERENCE_MAX_CORES];
+        spin_lock cores_lock;
+        vector<stripe> stripes;
+        // sharing detector, if there is one, sharded like the stripes
+        SharingDetector *sharing;
+
+        UINT32 stripe_of(ADDRINT line);
+        VOID access_l2(stripe *s, ADDRINT line, bool is_write);
+        VOID lock_cores(UINT64 mask);
+        VOID unlock_cores(UINT64 mask);
+        // goes through the directory for a miss or an upgrade of l1, by the
+        // instruction at ip accessing chunks of line
+        VOID transaction(PrivateCache *l1, ADDRINT line, UINT64 chunks,
+            ADDRINT ip, bool is_write);
+        // l1 replaced line, which was in state, with chunks written
+        VOID evicted(PrivateCache *l1, ADDRINT line, UINT8 state,
+            UINT64 written);
+        VOID access(PrivateCache *l1, ADDRINT line, UINT64 chunks,
+            ADDRINT ip, bool is_write);
+        VOID access_lines(PrivateCache *l1, VOID *addr, VOID *ip,
+            UINT32 size, bool is_write);
+
+    public:
+        // l2 is the shared level, the rest the geometry and replacement
+        // policy of every L1
+        CoherentHierarchy(Cache *pl2, UINT64 psize = 32*1024,
+            UINT64 pways = 8, UINT64 pline_len = 64,
+            string ppolicy_name = "lru");
+
+        // the L1 of thread tid, created the first time a thread of its core
+        // asks for it; safe to call from any thread
+        PrivateCache *add_thread(THREADID tid);
+        // classifies the coherence misses from now on; it must have
+        // ARQSIMUCOHERENCE_STRIPES shards, and lines as long as the L1s
+        VOID set_sharing_detector(SharingDetector *psharing);
+        // accesses from a thread of l1, which may run in parallel with the
+        // accesses of other cores
+        VOID read(PrivateCache *l1, VOID *addr, VOID *ip = NULL,
+            UINT32 size = 1);
+        VOID write(PrivateCache *l1, VOID *addr, VOID *ip = NULL,
+            UINT32 size = 1);
+        // references simulated so far
+        UINT64 get_accesses();
+        // the threads of the core with id, as "thread(s) a, b"
+        string describe_core(UINT32 id);
+        // once every thread is done
+        VOID output(std::ostream *outstream);
+};
+
+
+//spin_lock functions
+VOID init_lock(spin_lock *lock) {
+    lock->taken = 0;
+}
+
+VOID acquire_lock(spin_lock *lock) {
+    while (__sync_lock_test_and_set(&lock->taken, 1)) {
+        while (lock->taken)
+            ARQSIMU_YIELD();
+    }
+}
+
+VOID release_lock(spin_lock *lock) {
+    __sync_lock_release(&lock->taken);
+}
+
+
+//PrivateCache methods
+PrivateCache::PrivateCache(UINT32 pid, UINT64 size, UINT64 pways,
+    UINT64 line_len, string policy_name) :
+    id(pid), lines(size/(pways*line_len), pways),
+    states(size/line_len, ARQSIMUCOHERENCE_INVALID), written(size/line_len, 0),
+    ways(pways) {
+    init_lock(&lock);
+    memset(&counts, 0, sizeof(counts));
+
+    UINT64 sets = size/(ways*line_len);
+    index_len = log2((int)sets);
+    index_mask = sets - 1;
+    policy = make_replacement_policy(policy_name, sets, ways);
+    if (!policy)
+        policy = new FifoPolicy(sets, ways);
+}
+
+UINT32 PrivateCache::get_id() {
+    return id;
+}
+
+UINT8 PrivateCache::find(ADDRINT line, UINT64 *index, INT32 *way) {
+    *index = line & index_mask;
+    *way = lines.find(*index, line >> index_len);
+    if (*way < 0)
+        return ARQSIMUCOHERENCE_INVALID;
+    return states[*index*ways + *way];
+}
+
+VOID PrivateCache::touch(UINT64 index, UINT32 way) {
+    policy->touch(index, way);
+}
+
+VOID PrivateCache::set_state(UINT64 index, UINT32 way, UINT8 state) {
+    states[index*ways + way] = state;
+}
+
+VOID PrivateCache::add_written(UINT64 index, UINT32 way, UINT64 chunks) {
+    written[index*ways + way] |= chunks;
+}
+
+ADDRINT PrivateCache::fill(ADDRINT line, UINT8 state, UINT64 chunks,
+    UINT8 *victim_state, UINT64 *victim_written) {
+    UINT64 index = line & index_mask;
+    INT32 way = lines.find_free(index);
+    if (way < 0)
+        way = policy->victim(index);
+
+    ADDRINT victim = ARQSIMUHASH_EMPTY;
+    if (lines.is_valid(index, way)) {
+        victim = (lines.get_tag(index, way) << index_len) | index;
+        *victim_state = states[index*ways + way];
+        *victim_written = written[index*ways + way];
+    }
+
+    lines.fill(index, way, line >> index_len);
+    policy->insert(index, way);
+    states[index*ways + way] = state;
+    written[index*ways + way] = chunks;
+    return victim;
+}
+
+UINT8 PrivateCache::demote(ADDRINT line, UINT8 state,
+    UINT64 *old_written) {
+    UINT64 index;
+    INT32 way;
+    UINT8 old = find(line, &index, &way);
+    *old_written = 0;
+    if (old <= state)
+        return old;
+
+    if (state == ARQSIMUCOHERENCE_INVALID)
+        lines.invalidate(index, way);
+    states[index*ways + way] = state;
+    *old_written = written[index*ways + way];
+    written[index*ways + way] = 0;
+    return old;
+}
+
+
+//CoherentHierarchy methods
+CoherentHierarchy::stripe::stripe() : entries(64), l2_reads(0),
+    l2_read_hits(0), l2_writes(0), l2_write_hits(0) {
+    init_lock(&lock);
+}
+
+CoherentHierarchy::CoherentHierarchy(Cache *pl2, UINT64 psize,
+    UINT64 pways, UINT64 pline_len, string ppolicy_name) :
+    l2(pl2), size(psize), ways(pways), line_len(pline_len),
+    policy_name(ppolicy_name), stripes(ARQSIMUCOHERENCE_STRIPES),
+    sharing(NULL) {
+    offset_len = log2((int)line_len);
+    init_lock(&cores_lock);
+    for (UINT32 i = 0; i < ARQSIMUCOHERENCE_MAX_CORES; i++)
+        cores[i] = NULL;
+}
+
+PrivateCache *CoherentHierarchy::add_thread(THREADID tid) {
+    UINT32 id = tid % ARQSIMUCOHERENCE_MAX_CORES;
+
+    acquire_lock(&cores_lock);
+    if (!cores[id])
+        cores[id] = new PrivateCache(id, size, ways, line_len, policy_name);
+    PrivateCache *l1 = cores[id];
+    release_lock(&cores_lock);
+
+    acquire_lock(&l1->lock);
+    l1->threads.push_back(tid);
+    release_lock(&l1->lock);
+    return l1;
+}
+
+VOID CoherentHierarchy::set_sharing_detector(SharingDetector *psharing) {
+    sharing = psharing;
+}
+
+UINT32 CoherentHierarchy::stripe_of(ADDRINT line) {
+    return l2->get_set((VOID *)(line << offset_len)) &
+        (ARQSIMUCOHERENCE_STRIPES - 1);
+}
+
+VOID CoherentHierarchy::access_l2(stripe *s, ADDRINT line, bool is_write) {
+    VOID *victim;
+    bool hit = l2->access_local((VOID *)(line << offset_len), is_write,
+        &victim);
+    if (is_write) {
+        s->l2_writes++;
+        s->l2_write_hits += hit;
+    } else {
+        s->l2_reads++;
+        s->l2_read_hits += hit;
+    }
+}
+
+VOID CoherentHierarchy::lock_cores(UINT64 mask) {
+    for (UINT32 i = 0; i < ARQSIMUCOHERENCE_MAX_CORES; i++) {
+        if (mask & (1ULL << i))
+            acquire_lock(&cores[i]->lock);
+    }
+}
+
+VOID CoherentHierarchy::unlock_cores(UINT64 mask) {
+    for (UINT32 i = 0; i < ARQSIMUCOHERENCE_MAX_CORES; i++) {
+        if (mask & (1ULL << i))
+            release_lock(&cores[i]->lock);
+    }
+}
+
+VOID CoherentHierarchy::transaction(PrivateCache *l1, ADDRINT line,
+    UINT64 chunks, ADDRINT ip, bool is_write) {
+    UINT32 shard = stripe_of(line);
+    stripe *s = &stripes[shard];
+    acquire_lock(&s->lock);
+    directory_entry *entry = s->entries.get(line);
+    UINT64 me = 1ULL << l1->id;
+    UINT64 others = entry->sharers & ~me;
+    lock_cores(others | me);
+
+    // other cores may have taken the line away since the L1 was looked up
+    UINT64 index;
+    INT32 way;
+    UINT8 state = l1->find(line, &index, &way);
+    UINT8 new_state;
+    if (state != ARQSIMUCOHERENCE_INVALID &&
+        (!is_write || state >= ARQSIMUCOHERENCE_EXCLUSIVE)) {
+        // another thread of the core loaded it in the meantime
+        if (is_write) {
+            l1->counts.write_hits++;
+            l1->set_state(index, way, ARQSIMUCOHERENCE_MODIFIED);
+            l1->add_written(index, way, chunks);
+        } else {
+            l1->counts.read_hits++;
+        }
+        l1->touch(index, way);
+        unlock_cores(others | me);
+        release_lock(&s->lock);
+        return;
+    }
+
+    if (is_write) {
+        // every other copy goes, and the data comes from a modified one,
+        // if there is one, or from L2; the cores that lost the line before
+        // get to see what the modified one wrote
+        bool supplied = false, invalidated = false;
+        for (UINT32 i = 0; i < ARQSIMUCOHERENCE_MAX_CORES; i++) {
+            if (!(others & (1ULL << i)))
+                continue;
+            UINT64 written;
+            UINT8 old = cores[i]->demote(line, ARQSIMUCOHERENCE_INVALID,
+                &written);
+            if (old == ARQSIMUCOHERENCE_INVALID)
+                continue;
+            cores[i]->counts.invalidations++;
+            l1->counts.invalidations_sent++;
+            invalidated = true;
+            if (old == ARQSIMUCOHERENCE_MODIFIED) {
+                supplied = true;
+                if (sharing)
+                    sharing->handoff(shard, line, i, written,
+                        entry->invalidated);
+            }
+        }
+        if (sharing && invalidated)
+            sharing->invalidation(shard, line, ip);
+        entry->invalidated |= others;
+
+        if (state == ARQSIMUCOHERENCE_SHARED) {
+            l1->counts.upgrades++;
+            l1->counts.write_hits++;
+        } else if (!supplied) {
+            access_l2(s, line, false);
+        }
+        entry->sharers = me;
+        entry->exclusive = true;
+        new_state = ARQSIMUCOHERENCE_MODIFIED;
+    } else {
+        // a core that holds the line exclusive gives it, and keeps it
+        // shared; otherwise L2 does
+        bool supplied = false;
+        if (entry->exclusive && others) {
+            UINT32 owner = __builtin_ctzll(others);
+            UINT64 written;
+            UINT8 old = cores[owner]->demote(line, ARQSIMUCOHERENCE_SHARED,
+                &written);
+            if (old != ARQSIMUCOHERENCE_INVALID) {
+                cores[owner]->counts.interventions++;
+                supplied = true;
+            }
+            if (old == ARQSIMUCOHERENCE_MODIFIED) {
+                access_l2(s, line, true);
+                if (sharing)
+                    sharing->handoff(shard, line, owner, written,
+                        entry->invalidated);
+            }
+        }
+        if (!supplied)
+            access_l2(s, line, false);
+
+        new_state = others ? ARQSIMUCOHERENCE_SHARED :
+            ARQSIMUCOHERENCE_EXCLUSIVE;
+        entry->sharers |= me;
+        entry->exclusive = !others;
+    }
+
+    ADDRINT victim = ARQSIMUHASH_EMPTY;
+    UINT8 victim_state = ARQSIMUCOHERENCE_INVALID;
+    UINT64 victim_written = 0;
+    if (state == ARQSIMUCOHERENCE_INVALID) {
+        if (entry->invalidated & me) {
+            l1->counts.coherence_misses++;
+            entry->invalidated &= ~me;
+            if (sharing)
+                sharing->coherence_miss(shard, line, l1->id, chunks, ip);
+        }
+        victim = l1->fill(line, new_state, is_write ? chunks : 0,
+            &victim_state, &victim_written);
+    } else {
+        l1->set_state(index, way, new_state);
+        l1->touch(index, way);
+        if (is_write)
+            l1->add_written(index, way, chunks);
+    }
+
+    unlock_cores(others | me);
+    release_lock(&s->lock);
+
+    if (victim != ARQSIMUHASH_EMPTY)
+        evicted(l1, victim, victim_state, victim_written);
+}
+
+VOID CoherentHierarchy::evicted(PrivateCache *l1, ADDRINT line,
+    UINT8 state, UINT64 written) {
+    UINT32 shard = stripe_of(line);
+    stripe *s = &stripes[shard];
+    acquire_lock(&s->lock);
+    directory_entry *entry = s->entries.get(line);
+    if (state == ARQSIMUCOHERENCE_MODIFIED) {
+        access_l2(s, line, true);
+        if (sharing)
+            sharing->write_back(shard, line, l1->id, written,
+                entry->invalidated);
+    }
+
+    // a transaction of another core may have taken it out already
+    UINT64 me = 1ULL << l1->id;
+    if (entry->sharers & me) {
+        entry->sharers &= ~me;
+        if (!entry->sharers)
+            entry->exclusive = false;
+    }
+    // the directory only keeps the lines some core has or will miss on
+    // for coherence, so it grows with the L1s rather than the footprint
+    if (!entry->sharers && !entry->invalidated)
+        s->entries.erase(line);
+    release_lock(&s->lock);
+}
+
+VOID CoherentHierarchy::access(PrivateCache *l1, ADDRINT line,
+    UINT64 chunks, ADDRINT ip, bool is_write) {
+    acquire_lock(&l1->lock);
+    UINT64 index;
+    INT32 way;
+    UINT8 state = l1->find(line, &index, &way);
+    if (is_write)
+        l1->counts.writes++;
+    else
+        l1->counts.reads++;
+
+    if (!is_write && state != ARQSIMUCOHERENCE_INVALID) {
+        l1->counts.read_hits++;
+        l1->touch(index, way);
+        release_lock(&l1->lock);
+        return;
+    }
+    // exclusive lines become modified without telling anyone
+    if (is_write && state >= ARQSIMUCOHERENCE_EXCLUSIVE) {
+        l1->counts.write_hits++;
+        l1->set_state(index, way, ARQSIMUCOHERENCE_MODIFIED);
+        l1->add_written(index, way, chunks);
+        l1->touch(index, way);
+        release_lock(&l1->lock);
+        return;
+    }
+    release_lock(&l1->lock);
+
+    transaction(l1, line, chunks, ip, is_write);
+}
+
+VOID CoherentHierarchy::access_lines(PrivateCache *l1, VOID *addr,
+    VOID *ip, UINT32 size, bool is_write) {
+    ADDRINT start = (ADDRINT)addr, end = start + (size ? size : 1);
+    ADDRINT line = start >> offset_len, last = (end - 1) >> offset_len;
+
+    acquire_lock(&l1->lock);
+    l1->counts.accesses++;
+    l1->counts.splits += (line != last);
+    release_lock(&l1->lock);
+
+    for (; line <= last; line++) {
+        // the bytes of the access that fall in this line
+        UINT64 chunks = 0;
+        if (sharing) {
+            ADDRINT line_start = line << offset_len;
+            ADDRINT from = start > line_start ? start : line_start;
+            ADDRINT to = end < line_start + line_len ? end :
+                line_start + line_len;
+            chunks = sharing->chunks_of(from - line_start, to - from);
+        }
+        access(l1, line, chunks, (ADDRINT)ip, is_write);
+    }
+}
+
+VOID CoherentHierarchy::read(PrivateCache *l1, VOID *addr, VOID *ip,
+    UINT32 size) {
+    access_lines(l1, addr, ip, size, false);
+}
+
+VOID CoherentHierarchy::write(PrivateCache *l1, VOID *addr, VOID *ip,
+    UINT32 size) {
+    access_lines(l1, addr, ip, size, true);
+}
+
+UINT64 CoherentHierarchy::get_accesses() {
+    UINT64 accesses = 0;
+    for (UINT32 i = 0; i < ARQSIMUCOHERENCE_MAX_CORES; i++) {
+        if (cores[i])
+            accesses += cores[i]->counts.accesses;
+    }
+    return accesses;
+}
+
+string CoherentHierarchy::describe_core(UINT32 id) {
+    PrivateCache *l1 = cores[id];
+    string threads;
+    for (UINT32 i = 0; i < l1->threads.size(); i++)
+        threads += (i ? ", " : "") + uint_to_string(l1->threads[i]);
+    return string("thread") + (l1->threads.size() > 1 ? "s " : " ") +
+        threads;
+}
+
+VOID CoherentHierarchy::output(std::ostream *outstream) {
+    for (UINT32 i = 0; i < ARQSIMUCOHERENCE_MAX_CORES; i++) {
+        PrivateCache *l1 = cores[i];
+        if (!l1)
+            continue;
+        core_counts *counts = &l1->counts;
+
+        output_cache_stats(outstream, "L1 of " + describe_core(i),
+            counts->reads, counts->read_hits, counts->writes,
+            counts->write_hits, counts->splits, l1->policy->get_name());
+
+        UINT64 misses = counts->reads + counts->writes - counts->read_hits -
+            counts->write_hits;
+        *outstream << "\tcoherence misses/misses: " <<
+            uint_to_string(counts->coherence_misses) << " / " <<
+            uint_to_string(misses) << " = " <<
+            double_to_string(counts->coherence_misses/(double)misses) <<
+            std::endl;
+        *outstream << "\tupgrades/writes: " <<
+            uint_to_string(counts->upgrades) << " / " <<
+            uint_to_string(counts->writes) << " = " <<
+            double_to_string(counts->upgrades/(double)counts->writes) <<
+            std::endl;
+        *outstream << "\tinvalidations received: " <<
+            uint_to_string(counts->invalidations) << std::endl;
+        *outstream << "\tinterventions received: " <<
+            uint_to_string(counts->interventions) << std::endl;
+        *outstream << "\tinvalidations sent: " <<
+            uint_to_string(counts->invalidations_sent) << std::endl;
+    }
+
+    UINT64 reads = 0, read_hits = 0, writes = 0, write_hits = 0;
+    for (UINT32 i = 0; i < stripes.size(); i++) {
+        reads += stripes[i].l2_reads;
+        read_hits += stripes[i].l2_read_hits;
+        writes += stripes[i].l2_writes;
+        write_hits += stripes[i].l2_write_hits;
+    }
+    l2->count_accesses(reads, read_hits, writes, write_hits);
+    l2->output(outstream);
+}
+
+#endif
@@ -1,5 +1,5 @@
-#ifndef __ARQSIMUCACHE_HPP__
-#define __ARQSIMUCACHE_HPP__
+#ifndef __ARQSIMUCOMMONS_H__
+#define __ARQSIMUCOMMONS_H__
 
 #include <stdio.h>
 #include <list>
@@ -8,14 +8,21 @@
 #include <sstream>
 #include <fstream>
 #include <iostream>
-#include "pin.H"
+#include <sys/time.h>
+#include "arqsimutypes.h"
 
 int log2(int n);
 string uint_to_string(UINT64 n);
 string double_to_string(double n);
+string hex_to_string(UINT64 n);
+// seconds since the epoch, with microsecond resolution
+double wall_time();
 
 int log2(int n) {
-    return (log10(n))/(log10(2));
+    int bits = 0;
+    while (n >>= 1)
+        bits++;
+    return bits;
 }
 
 string uint_to_string(UINT64 n) {
@@ -30,4 +37,16 @@ string double_to_string(double n) {
     return stream.str();
 }
 
+string hex_to_string(UINT64 n) {
+    std::stringstream stream;
+    stream << "0x" << std::hex << n;
+    return stream.str();
+}
+
+double wall_time() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec/1e6;
+}
+
 #endif
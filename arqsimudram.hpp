@@ -0,0 +1,226 @@
+#ifndef __ARQSIMUDRAM_HPP__
+#define __ARQSIMUDRAM_HPP__
+
+#include "arqsimucache.hpp"
+
+// fields of an address that pick where in DRAM it is, from the most
+// significant to the least; the bits below a line are always the lowest
+#define ARQSIMUDRAM_FIELDS 5
+#define ARQSIMUDRAM_ROW 0
+#define ARQSIMUDRAM_RANK 1
+#define ARQSIMUDRAM_BANK 2
+#define ARQSIMUDRAM_CHANNEL 3
+#define ARQSIMUDRAM_COLUMN 4
+
+// default timings in cycles: activating a row (tRCD), reading or writing
+// a column of the open row (tCAS), and closing the row (tRP); an access to
+// a closed bank costs tRCD + tCAS, as much as an access to plain RAM
+#define ARQSIMUDRAM_TRCD 4
+#define ARQSIMUDRAM_TCAS 4
+#define ARQSIMUDRAM_TRP 4
+
+// Main memory made of channels of ranks of banks, each bank with a row
+// buffer that holds the row it read last. An access to the open row only
+// pays tCAS; an access to another row of the bank (a bank conflict) also
+// closes the open one first. With the closed page policy, banks close
+// their row right after every access, out of the way of the next one.
+//
+// The mapping says which address bits select each part, as the names of
+// the fields from the most significant to the least, separated by ':', row
+// first: "row:rank:bank:channel:column" keeps consecutive lines in the same
+// row, "row:column:rank:bank:channel" spreads them over channels and
+// banks.
+class DRAM : public Memory {
+    private:
+        UINT64 line_len, offset_len;
+        bool open_page;
+        UINT64 trcd, tcas, trp;
+        string mapping;
+        UINT64 counts[ARQSIMUDRAM_FIELDS];
+        UINT64 shifts[ARQSIMUDRAM_FIELDS], masks[ARQSIMUDRAM_FIELDS];
+        // open row of every bank, ARQSIMUCACHE_NOTAG if it's closed
+        vector<UINT64> open_rows;
+        vector<UINT64> bank_accesses;
+        UINT64 accesses, row_hits, row_misses, row_conflicts, cycles;
+
+        UINT64 field(ADDRINT line, UINT32 which);
+        UINT64 access(ADDRINT line);
+        UINT64 access_lines(VOID *addr, UINT32 size);
+
+    public:
+        // row_len is in bytes, and line_len the length of the lines asked
+        // for by the level above; parse_mapping() must accept pmapping, and
+        // is_dram_geometry() the rest
+        DRAM(UINT64 channels = 1, UINT64 ranks = 1, UINT64 banks = 8,
+            UINT64 row_len = 8192, UINT64 pline_len = 16,
+            string pmapping = "row:rank:bank:channel:column",
+            bool popen_page = true, UINT64 ptrcd = ARQSIMUDRAM_TRCD,
+            UINT64 ptcas = ARQSIMUDRAM_TCAS, UINT64 ptrp = ARQSIMUDRAM_TRP);
+
+        virtual UINT64 read(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        virtual UINT64 write(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        virtual VOID output(std::ostream *outstream);
+};
+
+// writes into order the field of each position of mapping, and returns
+// whether mapping names every field once, row first
+bool parse_mapping(string mapping, UINT32 *order);
+// whether DRAM can be sliced this way: every field takes whole address
+// bits, so the counts and row_len have to be powers of 2, and a row holds
+// at least a line
+bool is_dram_geometry(UINT64 channels, UINT64 ranks, UINT64 banks,
+    UINT64 row_len, UINT64 line_len);
+
+
+//DRAM methods
+bool parse_mapping(string mapping, UINT32 *order) {
+    static const char *names[ARQSIMUDRAM_FIELDS] = {"row", "rank", "bank",
+        "channel", "column"};
+    bool seen[ARQSIMUDRAM_FIELDS] = {false, false, false, false, false};
+
+    UINT32 position = 0;
+    size_t start = 0;
+    while (start <= mapping.size()) {
+        size_t end = mapping.find(':', start);
+        if (end == string::npos)
+            end = mapping.size();
+        string name = mapping.substr(start, end - start);
+        start = end + 1;
+
+        UINT32 which = 0;
+        while (which < ARQSIMUDRAM_FIELDS && name != names[which])
+            which++;
+        if (which == ARQSIMUDRAM_FIELDS || seen[which] ||
+            position == ARQSIMUDRAM_FIELDS)
+            return false;
+        seen[which] = true;
+        order[position++] = which;
+    }
+    return position == ARQSIMUDRAM_FIELDS && order[0] == ARQSIMUDRAM_ROW;
+}
+
+bool is_dram_geometry(UINT64 channels, UINT64 ranks, UINT64 banks,
+    UINT64 row_len, UINT64 line_len) {
+    UINT64 sizes[4] = {channels, ranks, banks, row_len};
+    for (UINT32 i = 0; i < 4; i++) {
+        if (sizes[i] != (1ULL << log2((int)sizes[i])))
+            return false;
+    }
+    return row_len >= line_len;
+}
+
+DRAM::DRAM(UINT64 channels, UINT64 ranks, UINT64 banks, UINT64 row_len,
+    UINT64 pline_len, string pmapping, bool popen_page, UINT64 ptrcd,
+    UINT64 ptcas, UINT64 ptrp) :
+    Memory(ptrcd + ptcas), line_len(pline_len), open_page(popen_page),
+    trcd(ptrcd), tcas(ptcas), trp(ptrp), mapping(pmapping),
+    open_rows(channels*ranks*banks, ARQSIMUCACHE_NOTAG),
+    bank_accesses(channels*ranks*banks, 0), accesses(0), row_hits(0),
+    row_misses(0), row_conflicts(0), cycles(0) {
+    offset_len = log2((int)line_len);
+
+    counts[ARQSIMUDRAM_CHANNEL] = channels;
+    counts[ARQSIMUDRAM_RANK] = ranks;
+    counts[ARQSIMUDRAM_BANK] = banks;
+    counts[ARQSIMUDRAM_COLUMN] = row_len/line_len;
+    // rows take every bit left
+    counts[ARQSIMUDRAM_ROW] = 0;
+
+    UINT32 order[ARQSIMUDRAM_FIELDS];
+    parse_mapping(mapping, order);
+    UINT64 shift = 0;
+    for (INT32 position = ARQSIMUDRAM_FIELDS - 1; position >= 0;
+        position--) {
+        UINT32 which = order[position];
+        shifts[which] = shift;
+        if (which == ARQSIMUDRAM_ROW) {
+            masks[which] = ~0ULL;
+        } else {
+            masks[which] = counts[which] - 1;
+            shift += log2((int)counts[which]);
+        }
+    }
+}
+
+UINT64 DRAM::field(ADDRINT line, UINT32 which) {
+    return (line >> shifts[which]) & masks[which];
+}
+
+UINT64 DRAM::access(ADDRINT line) {
+    UINT64 bank = (field(line, ARQSIMUDRAM_CHANNEL)*counts[ARQSIMUDRAM_RANK] +
+        field(line, ARQSIMUDRAM_RANK))*counts[ARQSIMUDRAM_BANK] +
+        field(line, ARQSIMUDRAM_BANK);
+    UINT64 row = field(line, ARQSIMUDRAM_ROW);
+    accesses++;
+    bank_accesses[bank]++;
+
+    UINT64 overhead = tcas;
+    if (open_rows[bank] == row) {
+        row_hits++;
+    } else if (open_rows[bank] == ARQSIMUCACHE_NOTAG) {
+        row_misses++;
+        overhead += trcd;
+    } else {
+        row_conflicts++;
+        overhead += trp + trcd;
+    }
+
+    open_rows[bank] = open_page ? row : ARQSIMUCACHE_NOTAG;
+    cycles += overhead;
+    return overhead;
+}
+
+UINT64 DRAM::access_lines(VOID *addr, UINT32 size) {
+    UINT64 total_overhead = 0;
+    ADDRINT line = (ADDRINT)addr >> offset_len;
+    ADDRINT last = ((ADDRINT)addr + (size ? size : 1) - 1) >> offset_len;
+    for (; line <= last; line++)
+        total_overhead += access(line);
+    return total_overhead;
+}
+
+UINT64 DRAM::read(VOID *addr, VOID *ip, UINT32 size) {
+    return access_lines(addr, size);
+}
+
+UINT64 DRAM::write(VOID *addr, VOID *ip, UINT32 size) {
+    return access_lines(addr, size);
+}
+
+VOID DRAM::output(std::ostream *outstream) {
+    *outstream << "=====" << std::endl;
+    *outstream << "DRAM:" << std::endl;
+    *outstream << "\trow hits/accesses: " << uint_to_string(row_hits) <<
+        " / " << uint_to_string(accesses) << " = " <<
+        double_to_string(row_hits/(double)accesses) << std::endl;
+    *outstream << "\tbank conflicts/accesses: " <<
+        uint_to_string(row_conflicts) << " / " << uint_to_string(accesses) <<
+        " = " << double_to_string(row_conflicts/(double)accesses) <<
+        std::endl;
+    *outstream << "\tclosed bank accesses/accesses: " <<
+        uint_to_string(row_misses) << " / " << uint_to_string(accesses) <<
+        " = " << double_to_string(row_misses/(double)accesses) << std::endl;
+    *outstream << "\tcycles/accesses: " << uint_to_string(cycles) << " / " <<
+        uint_to_string(accesses) << " = " <<
+        double_to_string(cycles/(double)accesses) << std::endl;
+
+    UINT64 busiest = 0;
+    for (UINT64 bank = 0; bank < bank_accesses.size(); bank++) {
+        if (bank_accesses[bank] > busiest)
+            busiest = bank_accesses[bank];
+    }
+    *outstream << "\taccesses to the busiest bank: " <<
+        uint_to_string(busiest) << " of " << uint_to_string(accesses) <<
+        std::endl;
+
+    *outstream << "\t" << uint_to_string(counts[ARQSIMUDRAM_CHANNEL]) <<
+        " channels, " << uint_to_string(counts[ARQSIMUDRAM_RANK]) <<
+        " ranks, " << uint_to_string(counts[ARQSIMUDRAM_BANK]) <<
+        " banks, " << uint_to_string(counts[ARQSIMUDRAM_COLUMN]*line_len) <<
+        " byte rows, " << (open_page ? "open" : "closed") << " page, " <<
+        "mapping " << mapping << std::endl;
+    *outstream << "\ttRCD " << uint_to_string(trcd) << ", tCAS " <<
+        uint_to_string(tcas) << ", tRP " << uint_to_string(trp) << std::endl;
+}
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef __ARQSIMUHASH_H__
+#define __ARQSIMUHASH_H__
+
+#include "arqsimucommons.h"
+
+// key of the empty slots; no address or line number takes this value
+#define ARQSIMUHASH_EMPTY 0xFFFFFFFFFFFFFFFFULL
+
+// Open addressing hash table from addresses (or line numbers, ips) to
+// values, with linear probing. The table either grows to keep its load
+// under 1/2, or has a fixed capacity and refuses new keys when it's full,
+// so that its memory stays bounded.
+template <class V> class AddrMap {
+    private:
+        vector<UINT64> keys;
+        vector<V> values;
+        UINT64 used, mask;
+        bool fixed;
+
+        UINT64 slot(UINT64 key);
+        VOID grow();
+
+    public:
+        AddrMap(UINT64 capacity = 1024, bool pfixed = false);
+
+        // returns the value for key, or NULL if it's not in the table
+        V *find(UINT64 key);
+        // same, but inserts a default value if the key isn't there; returns
+        // NULL only if the table is fixed and full
+        V *get(UINT64 key);
+        // removes key and its value, if it's there
+        VOID erase(UINT64 key);
+
+        UINT64 size();
+        // slots, for walking over the table: a slot is in use if its key is
+        // not ARQSIMUHASH_EMPTY
+        UINT64 slots();
+        UINT64 key_at(UINT64 i);
+        V *value_at(UINT64 i);
+};
+
+
+//AddrMap methods
+template <class V>
+AddrMap<V>::AddrMap(UINT64 capacity, bool pfixed) : used(0), fixed(pfixed) {
+    UINT64 nslots = 16;
+    // twice the capacity, so probes stay short when the table is full
+    while (nslots < 2*capacity)
+        nslots <<= 1;
+
+    keys.assign(nslots, ARQSIMUHASH_EMPTY);
+    values.assign(nslots, V());
+    mask = nslots - 1;
+}
+
+template <class V>
+UINT64 AddrMap<V>::slot(UINT64 key) {
+    // fibonacci hashing spreads the aligned addresses over the table
+    return ((key * 0x9E3779B97F4A7C15ULL) >> 20) & mask;
+}
+
+template <class V>
+VOID AddrMap<V>::grow() {
+    vector<UINT64> old_keys;
+    vector<V> old_values;
+    old_keys.swap(keys);
+    old_values.swap(values);
+
+    keys.assign(2*old_keys.size(), ARQSIMUHASH_EMPTY);
+    values.assign(2*old_keys.size(), V());
+    mask = keys.size() - 1;
+
+    for (UINT64 i = 0; i < old_keys.size(); i++) {
+        if (old_keys[i] == ARQSIMUHASH_EMPTY)
+            continue;
+
+        UINT64 j = slot(old_keys[i]);
+        while (keys[j] != ARQSIMUHASH_EMPTY)
+            j = (j + 1) & mask;
+        keys[j] = old_keys[i];
+        values[j] = old_values[i];
+    }
+}
+
+template <class V>
+V *AddrMap<V>::find(UINT64 key) {
+    for (UINT64 i = slot(key); keys[i] != ARQSIMUHASH_EMPTY;
+        i = (i + 1) & mask) {
+        if (keys[i] == key)
+            return &values[i];
+    }
+    return NULL;
+}
+
+template <class V>
+V *AddrMap<V>::get(UINT64 key) {
+    UINT64 i = slot(key);
+    for (; keys[i] != ARQSIMUHASH_EMPTY; i = (i + 1) & mask) {
+        if (keys[i] == key)
+            return &values[i];
+    }
+
+    if (2*(used + 1) > keys.size()) {
+        if (fixed)
+            return NULL;
+        grow();
+        return get(key);
+    }
+
+    keys[i] = key;
+    used++;
+    return &values[i];
+}
+
+template <class V>
+VOID AddrMap<V>::erase(UINT64 key) {
+    UINT64 i = slot(key);
+    for (; keys[i] != key; i = (i + 1) & mask) {
+        if (keys[i] == ARQSIMUHASH_EMPTY)
+            return;
+    }
+
+    // the keys probed past the hole move back into it, unless their own
+    // slot comes after it, so that nothing is left out of its probe run
+    for (UINT64 j = (i + 1) & mask; keys[j] != ARQSIMUHASH_EMPTY;
+        j = (j + 1) & mask) {
+        if (((j - slot(keys[j])) & mask) >= ((j - i) & mask)) {
+            keys[i] = keys[j];
+            values[i] = values[j];
+            i = j;
+        }
+    }
+    keys[i] = ARQSIMUHASH_EMPTY;
+    values[i] = V();
+    used--;
+}
+
+template <class V>
+UINT64 AddrMap<V>::size() {
+    return used;
+}
+
+template <class V>
+UINT64 AddrMap<V>::slots() {
+    return keys.size();
+}
+
+template <class V>
+UINT64 AddrMap<V>::key_at(UINT64 i) {
+    return keys[i];
+}
+
+template <class V>
+V *AddrMap<V>::value_at(UINT64 i) {
+    return &values[i];
+}
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef __ARQSIMUHIERARCHY_HPP__
+#define __ARQSIMUHIERARCHY_HPP__
+
+#include "arqsimucache.hpp"
+
+// floor(log2(N)) at compile time, like log2() does at run time
+template <UINT64 N> struct StaticLog2 {
+    static const UINT64 value = 1 + StaticLog2<N/2>::value;
+};
+
+template <> struct StaticLog2<1> {
+    static const UINT64 value = 0;
+};
+
+
+// Cache level whose geometry and next level are fixed at compile time. It
+// simulates exactly what Cache does, but the address is split with constant
+// shifts and masks and the next level is called without going through the
+// vtable, so a whole chain of these inlines into the first level's read()
+// and write(). Lines are always replaced in FIFO order.
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+class StaticCache : public Memory {
+    public:
+        static const UINT64 SETS = SIZE/(WAYS*LINE_LEN);
+        static const UINT64 OFFSET_LEN = StaticLog2<LINE_LEN>::value;
+        static const UINT64 INDEX_LEN = StaticLog2<SETS>::value;
+        static const UINT64 INDEX_MASK = (1ULL << INDEX_LEN) - 1;
+
+    private:
+        string description;
+        NEXT *next;
+        TagStore lines;
+        // called on the object, so its methods aren't virtual calls
+        FifoPolicy policy;
+        UINT64 reads, writes, read_hits, write_hits, splits;
+
+        UINT64 replace(UINT64 index, UINT32 way, UINT64 tag, VOID *addr);
+        UINT64 read_line(VOID *addr);
+        UINT64 write_line(VOID *addr);
+        UINT64 split_access(VOID *addr, UINT32 size, bool is_write);
+
+    public:
+        StaticCache(string pdescription, NEXT *pnext);
+
+        virtual UINT64 read(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        virtual UINT64 write(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        virtual VOID output(std::ostream *outstream);
+        virtual VOID count_hits(UINT64 read_hits, UINT64 write_hits);
+};
+
+
+//StaticCache methods
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+StaticCache<SIZE, WAYS, LINE_LEN, NEXT>::StaticCache(string pdescription,
+    NEXT *pnext) : Memory(cache_overhead(pdescription)),
+    description(pdescription), next(pnext), lines(SETS, WAYS),
+    policy(SETS, WAYS), reads(0), writes(0), read_hits(0), write_hits(0),
+    splits(0) {}
+
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+UINT64 StaticCache<SIZE, WAYS, LINE_LEN, NEXT>::replace(UINT64 index,
+    UINT32 way, UINT64 tag, VOID *addr) {
+    UINT64 total_overhead = 0;
+
+    // qualified calls are resolved at compile time and can be inlined; the
+    // victim goes down after the line is read, as in Cache
+    total_overhead += next->NEXT::read((VOID *)((UINT64)addr &
+        ~(LINE_LEN - 1)), NULL, LINE_LEN);
+    if (lines.is_valid(index, way) && lines.is_dirty(index, way)) {
+        UINT64 victim_tag = lines.get_tag(index, way);
+        total_overhead += next->NEXT::write((VOID *)
+            (((victim_tag << INDEX_LEN) | index) << OFFSET_LEN), NULL,
+            LINE_LEN);
+    }
+    lines.fill(index, way, tag);
+    return total_overhead;
+}
+
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+UINT64 StaticCache<SIZE, WAYS, LINE_LEN, NEXT>::read(VOID *addr,
+    VOID *ip, UINT32 size) {
+    if (crosses_line(addr, size, LINE_LEN))
+        return split_access(addr, size, false);
+    return read_line(addr);
+}
+
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+UINT64 StaticCache<SIZE, WAYS, LINE_LEN, NEXT>::write(VOID *addr,
+    VOID *ip, UINT32 size) {
+    if (crosses_line(addr, size, LINE_LEN))
+        return split_access(addr, size, true);
+    return write_line(addr);
+}
+
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+UINT64 StaticCache<SIZE, WAYS, LINE_LEN, NEXT>::split_access(VOID *addr,
+    UINT32 size, bool is_write) {
+    splits++;
+
+    UINT64 total_overhead = 0;
+    UINT64 start = (UINT64)addr, end = start + size;
+    for (; start < end; start = (start | (LINE_LEN - 1)) + 1) {
+        if (is_write)
+            total_overhead += write_line((VOID *)start);
+        else
+            total_overhead += read_line((VOID *)start);
+    }
+    return total_overhead;
+}
+
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+UINT64 StaticCache<SIZE, WAYS, LINE_LEN, NEXT>::read_line(VOID *addr) {
+    reads++;
+    UINT64 index = ((UINT64)addr >> OFFSET_LEN) & INDEX_MASK;
+    UINT64 tag = (UINT64)addr >> (OFFSET_LEN + INDEX_LEN);
+
+    UINT64 total_overhead = 0;
+    if (lines.find<WAYS>(index, tag) >= 0)
+        read_hits++;
+    else
+        total_overhead += replace(index, policy.victim(index), tag, addr);
+
+    total_overhead += get_overhead();
+    return total_overhead;
+}
+
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+UINT64 StaticCache<SIZE, WAYS, LINE_LEN, NEXT>::write_line(VOID *addr) {
+    writes++;
+    UINT64 index = ((UINT64)addr >> OFFSET_LEN) & INDEX_MASK;
+    UINT64 tag = (UINT64)addr >> (OFFSET_LEN + INDEX_LEN);
+
+    UINT64 total_overhead = 0;
+    INT32 way = lines.find<WAYS>(index, tag);
+    if (way >= 0) {
+        write_hits++;
+    } else {
+        way = policy.victim(index);
+        total_overhead += replace(index, way, tag, addr);
+    }
+
+    lines.mark_dirty(index, way);
+
+    total_overhead += get_overhead();
+    return total_overhead;
+}
+
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+VOID StaticCache<SIZE, WAYS, LINE_LEN, NEXT>::count_hits(UINT64 pread_hits,
+    UINT64 pwrite_hits) {
+    reads += pread_hits;
+    read_hits += pread_hits;
+    writes += pwrite_hits;
+    write_hits += pwrite_hits;
+}
+
+template <UINT64 SIZE, UINT64 WAYS, UINT64 LINE_LEN, class NEXT>
+VOID StaticCache<SIZE, WAYS, LINE_LEN, NEXT>::output(
+    std::ostream *outstream) {
+    output_cache_stats(outstream, description, reads, read_hits, writes,
+        write_hits, splits, policy.get_name());
+    next->output(outstream);
+}
+
+
+// L1 -> L2 -> RAM chain with both geometries fixed at compile time
+template <UINT64 L1_SIZE, UINT64 L1_WAYS, UINT64 L1_LINE_LEN,
+    UINT64 L2_SIZE, UINT64 L2_WAYS, UINT64 L2_LINE_LEN>
+Memory *make_static_hierarchy() {
+    typedef StaticCache<L2_SIZE, L2_WAYS, L2_LINE_LEN, RAM> L2;
+    typedef StaticCache<L1_SIZE, L1_WAYS, L1_LINE_LEN, L2> L1;
+
+    return new L1("L1", new L2("L2", new RAM()));
+}
+
+// Geometries that get a specialized hierarchy, as
+// (L1 size, ways, line length, L2 size, ways, line length)
+#define ARQSIMU_STATIC_HIERARCHIES(X) \
+    X(64*1024, 2, 16, 1000*1024, 2, 16) \
+    X(32*1024, 8, 64, 256*1024, 8, 64) \
+    X(32*1024, 8, 64, 1024*1024, 16, 64) \
+    X(48*1024, 12, 64, 1280*1024, 20, 64) \
+    X(64*1024, 4, 64, 512*1024, 8, 64)
+
+// Builds an L1 -> L2 -> RAM hierarchy. If the geometry is one of
+// ARQSIMU_STATIC_HIERARCHIES and both levels replace lines in FIFO order,
+// the specialized chain is returned and *specialized is set; otherwise it's
+// made of generic Cache levels.
+Memory *make_hierarchy(UINT64 l1_size, UINT64 l1_ways, UINT64 l1_line_len,
+    UINT64 l2_size, UINT64 l2_ways, UINT64 l2_line_len,
+    string l1_policy = "fifo", string l2_policy = "fifo",
+    bool *specialized = NULL);
+
+Memory *make_hierarchy(UINT64 l1_size, UINT64 l1_ways, UINT64 l1_line_len,
+    UINT64 l2_size, UINT64 l2_ways, UINT64 l2_line_len, string l1_policy,
+    string l2_policy, bool *specialized) {
+    if (specialized)
+        *specialized = true;
+
+    bool fifo = (l1_policy == "fifo" && l2_policy == "fifo");
+
+#define ARQSIMU_PICK_STATIC_HIERARCHY(s1, w1, l1, s2, w2, l2) \
+    if (fifo && \
+        l1_size == (s1) && l1_ways == (w1) && l1_line_len == (l1) && \
+        l2_size == (s2) && l2_ways == (w2) && l2_line_len == (l2)) \
+        return make_static_hierarchy<s1, w1, l1, s2, w2, l2>();
+
+    ARQSIMU_STATIC_HIERARCHIES(ARQSIMU_PICK_STATIC_HIERARCHY)
+#undef ARQSIMU_PICK_STATIC_HIERARCHY
+
+    if (specialized)
+        *specialized = false;
+
+    RAM *ram = new RAM();
+    Cache *l2 = new Cache("L2", ram, l2_size, l2_ways, l2_line_len,
+        l2_policy);
+    return new Cache("L1", l2, l1_size, l1_ways, l1_line_len, l1_policy);
+}
+
+
+// Geometry and replacement policies of an L1 -> L2 -> RAM hierarchy
+struct hierarchy_config {
+    UINT64 l1_size, l1_ways, l1_line_len;
+    UINT64 l2_size, l2_ways, l2_line_len;
+    string l1_policy, l2_policy;
+};
+
+// Parses a list of hierarchies separated by ';', each written as
+// "size:ways:line_len,size:ways:line_len" for L1 and L2. Sizes may end in
+// k or m, and a level may add ":policy" to replace lines with a policy
+// other than fifo. Line lengths and the number of sets of each level have
+// to be powers of 2, since addresses are split in bits.
+bool parse_hierarchy_configs(string spec, vector<hierarchy_config> *configs);
+string describe_hierarchy_config(const hierarchy_config &config);
+
+static bool is_cache_geometry(UINT64 size, UINT64 ways, UINT64 line_len) {
+    if (!ways || line_len != (1ULL << log2((int)line_len)) ||
+        size % (ways*line_len))
+        return false;
+    UINT64 sets = size/(ways*line_len);
+    return sets == (1ULL << log2((int)sets));
+}
+
+static bool parse_cache_geometry(string spec, UINT64 *size, UINT64 *ways,
+    UINT64 *line_len, string *policy) {
+    std::istringstream stream(spec);
+    char unit = 0, colon1 = 0, colon2 = 0;
+
+    if (!(stream >> *size))
+        return false;
+    if (stream.peek() == 'k' || stream.peek() == 'm')
+        stream >> unit;
+    if (!(stream >> colon1 >> *ways >> colon2 >> *line_len))
+        return false;
+    if (colon1 != ':' || colon2 != ':')
+        return false;
+
+    *policy = "fifo";
+    if (stream.peek() == ':') {
+        stream.get();
+        std::getline(stream, *policy);
+        if (!is_replacement_policy(*policy))
+            return false;
+    } else if (stream.peek() != EOF) {
+        return false;
+    }
+
+    if (unit == 'k')
+        *size *= 1024;
+    else if (unit == 'm')
+        *size *= 1024*1024;
+    return is_cache_geometry(*size, *ways, *line_len);
+}
+
+bool parse_hierarchy_configs(string spec, vector<hierarchy_config> *configs) {
+    std::istringstream stream(spec);
+    string hierarchy;
+
+    while (std::getline(stream, hierarchy, ';')) {
+        size_t comma = hierarchy.find(',');
+        if (comma == string::npos)
+            return false;
+
+        hierarchy_config config;
+        if (!parse_cache_geometry(hierarchy.substr(0, comma),
+                &config.l1_size, &config.l1_ways, &config.l1_line_len,
+                &config.l1_policy) ||
+            !parse_cache_geometry(hierarchy.substr(comma + 1),
+                &config.l2_size, &config.l2_ways, &config.l2_line_len,
+                &config.l2_policy))
+            return false;
+        configs->push_back(config);
+    }
+
+    return !configs->empty();
+}
+
+string describe_hierarchy_config(const hierarchy_config &config) {
+    return "L1 " + uint_to_string(config.l1_size) + ":" +
+        uint_to_string(config.l1_ways) + ":" +
+        uint_to_string(config.l1_line_len) + ":" + config.l1_policy +
+        ", L2 " + uint_to_string(config.l2_size) + ":" +
+        uint_to_string(config.l2_ways) + ":" +
+        uint_to_string(config.l2_line_len) + ":" + config.l2_policy;
+}
+
+#endif
@@ -67,7 +67,8 @@ class TwoBitHysteresisHistoryPredictor : public HistoryPredictor {
 };
 
 //Predictor methods
-Predictor::Predictor(string pdescription) : description(pdescription) {}
+Predictor::Predictor(string pdescription) : description(pdescription),
+    predictions(0), hits(0) {}
 
 VOID Predictor::output(std::ostream *outstream) {
     *outstream << "=====" << std::endl;
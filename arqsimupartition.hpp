@@ -0,0 +1,283 @@
+#ifndef __ARQSIMUPARTITION_HPP__
+#define __ARQSIMUPARTITION_HPP__
+
+#include <string.h>
+#include "arqsimucache.hpp"
+
+// L1 -> L2 -> RAM hierarchy simulated by several worker threads, which
+// split the sets of each level between them: worker w owns the sets whose
+// index modulo the number of workers is w. Sets don't share state, so as
+// long as every set sees its accesses in the original order the counters
+// end up exactly as if Cache::read() and write() had been called one by one.
+//
+// References are simulated in batches, in two pipeline stages. In phase p
+// every worker runs its L1 sets over batch p, leaving for each reference
+// the requests it sends to L2 (the read of the missing line, then the write
+// back of a dirty victim), and runs its L2 sets over the requests left by
+// batch p-1. RAM keeps no state, so L2 misses aren't forwarded to it.
+//
+// References that span several L1 lines are split by the producer, one
+// reference per line, so that each of them belongs to a single set. An L1
+// line read from L2 is split by the workers, if L2 lines are shorter.
+//
+// The producer starts a phase once the previous one is over and goes back
+// to collecting references, and the workers wait for it spinning on the
+// phase counter, so nothing is locked.
+class PartitionedHierarchy {
+    private:
+        // counters written by different threads live in different host
+        // cache lines
+        struct counter {
+            volatile UINT64 value;
+            UINT8 padding[56];
+        };
+        struct level_counts {
+            UINT64 reads, read_hits, writes, write_hits, splits;
+        };
+        struct worker_counts {
+            level_counts l1, l2;
+            UINT8 padding[64];
+        };
+
+        Cache *l1, *l2;
+        UINT32 workers;
+        UINT64 batch_len;
+        // batches and their L2 requests, double buffered: phase p reads
+        // batch p % 2 and writes requests p % 2, while its stage 2 reads
+        // requests (p - 1) % 2
+        vector<memref> batches[2];
+        vector<ADDRINT> requests[2];
+        UINT64 lengths[2];
+        // the references of a simulate() call, split by L1 line, if some
+        // of them span several
+        vector<memref> pieces;
+        UINT64 l1_splits;
+        // phases started, and phases finished by each worker in total
+        counter started, finished;
+        vector<worker_counts> counts;
+        volatile bool stopped;
+
+        VOID run_l1(UINT32 worker, UINT64 phase);
+        VOID run_l2(UINT32 worker, UINT64 phase);
+        VOID access_l2(UINT32 worker, VOID *addr, bool is_write);
+        // waits until every worker is done with every phase started
+        VOID wait_phases();
+        VOID start_phase(const memref *refs, UINT64 n);
+
+    public:
+        PartitionedHierarchy(Cache *pl1, Cache *pl2, UINT32 pworkers = 2,
+            UINT64 pbatch_len = 4096);
+
+        UINT32 get_workers();
+        // producer side, a single thread at a time: simulates refs, and
+        // returns while the workers are still on them
+        VOID simulate(const memref *refs, UINT64 n);
+        // finishes what has been submitted and adds the counts of every
+        // worker to the caches
+        VOID flush();
+        // makes the workers return, once flushed
+        VOID stop();
+
+        // body of worker thread number worker
+        VOID run(UINT32 worker);
+};
+
+
+//PartitionedHierarchy methods
+PartitionedHierarchy::PartitionedHierarchy(Cache *pl1, Cache *pl2,
+    UINT32 pworkers, UINT64 pbatch_len) : l1(pl1), l2(pl2),
+    workers(pworkers), batch_len(pbatch_len), l1_splits(0),
+    counts(pworkers), stopped(false) {
+    for (UINT32 i = 0; i < 2; i++) {
+        batches[i].resize(batch_len);
+        requests[i].resize(2*batch_len);
+        lengths[i] = 0;
+    }
+    started.value = 0;
+    finished.value = 0;
+
+    for (UINT32 i = 0; i < workers; i++) {
+        memset(&counts[i].l1, 0, sizeof(level_counts));
+        memset(&counts[i].l2, 0, sizeof(level_counts));
+    }
+}
+
+UINT32 PartitionedHierarchy::get_workers() {
+    return workers;
+}
+
+VOID PartitionedHierarchy::run_l1(UINT32 worker, UINT64 phase) {
+    const memref *refs = &batches[phase % 2][0];
+    ADDRINT *out = &requests[phase % 2][0];
+    level_counts *l1_counts = &counts[worker].l1;
+
+    for (UINT64 i = 0; i < lengths[phase % 2]; i++) {
+        VOID *addr = (VOID *)refs[i].addr;
+        if (l1->get_set(addr) % workers != worker)
+            continue;
+
+        VOID *victim;
+        bool hit = l1->access_local(addr, refs[i].is_write, &victim);
+        if (refs[i].is_write) {
+            l1_counts->writes++;
+            l1_counts->write_hits += hit;
+        } else {
+            l1_counts->reads++;
+            l1_counts->read_hits += hit;
+        }
+
+        // the whole line is read from L2, like Cache::forward_miss() does
+        out[2*i] = hit ? ARQSIMUCACHE_NOTAG :
+            refs[i].addr & ~(l1->get_line_len() - 1);
+        out[2*i + 1] = (ADDRINT)victim;
+    }
+}
+
+VOID PartitionedHierarchy::run_l2(UINT32 worker, UINT64 phase) {
+    if (!phase)
+        return;
+
+    const ADDRINT *in = &requests[(phase - 1) % 2][0];
+    UINT64 n = 2*lengths[(phase - 1) % 2];
+    level_counts *l2_counts = &counts[worker].l2;
+
+    // even requests are line reads, odd ones are write backs, of whole L1
+    // lines; the worker that owns the first L2 line counts the split
+    UINT64 l1_line_len = l1->get_line_len(), l2_line_len = l2->get_line_len();
+    for (UINT64 i = 0; i < n; i++) {
+        if (in[i] == ARQSIMUCACHE_NOTAG)
+            continue;
+
+        bool is_write = (i & 1);
+        if (l1_line_len > l2_line_len &&
+            l2->get_set((VOID *)in[i]) % workers == worker)
+            l2_counts->splits++;
+        for (ADDRINT addr = in[i]; addr < in[i] + l1_line_len;
+            addr += l2_line_len)
+            access_l2(worker, (VOID *)addr, is_write);
+    }
+}
+
+VOID PartitionedHierarchy::access_l2(UINT32 worker, VOID *addr,
+    bool is_write) {
+    if (l2->get_set(addr) % workers != worker)
+        return;
+
+    level_counts *l2_counts = &counts[worker].l2;
+    VOID *victim;
+    bool hit = l2->access_local(addr, is_write, &victim);
+    if (is_write) {
+        l2_counts->writes++;
+        l2_counts->write_hits += hit;
+    } else {
+        l2_counts->reads++;
+        l2_counts->read_hits += hit;
+    }
+}
+
+VOID PartitionedHierarchy::run(UINT32 worker) {
+    for (UINT64 phase = 0; ; phase++) {
+        while (started.value == phase) {
+            if (stopped)
+                return;
+            ARQSIMU_YIELD();
+        }
+        __sync_synchronize();
+
+        run_l1(worker, phase);
+        run_l2(worker, phase);
+
+        __sync_fetch_and_add(&finished.value, 1);
+    }
+}
+
+VOID PartitionedHierarchy::wait_phases() {
+    while (finished.value != started.value*workers)
+        ARQSIMU_YIELD();
+    __sync_synchronize();
+}
+
+VOID PartitionedHierarchy::start_phase(const memref *refs, UINT64 n) {
+    // stage 2 of this phase reads what stage 1 of the previous one left,
+    // so phases don't overlap; the producer does while they run
+    wait_phases();
+
+    UINT64 phase = started.value;
+    if (n)
+        memcpy(&batches[phase % 2][0], refs, n*sizeof(memref));
+    lengths[phase % 2] = n;
+
+    // the batch must be complete before the workers can see it
+    __sync_synchronize();
+    started.value++;
+}
+
+VOID PartitionedHierarchy::simulate(const memref *refs, UINT64 n) {
+    UINT64 line_len = l1->get_line_len();
+    // references are only copied when some of them have to be split,
+    // which most calls don't have
+    UINT64 first = 0;
+    while (first < n &&
+        !crosses_line((VOID *)refs[first].addr, refs[first].size, line_len))
+        first++;
+
+    if (first < n) {
+        pieces.assign(refs, refs + first);
+        for (UINT64 i = first; i < n; i++) {
+            if (!crosses_line((VOID *)refs[i].addr, refs[i].size,
+                    line_len)) {
+                pieces.push_back(refs[i]);
+                continue;
+            }
+
+            l1_splits++;
+            memref piece = refs[i];
+            ADDRINT end = refs[i].addr + refs[i].size;
+            while (piece.addr < end) {
+                ADDRINT line_end = (piece.addr | (line_len - 1)) + 1;
+                piece.size = (line_end < end ? line_end : end) - piece.addr;
+                pieces.push_back(piece);
+                piece.addr = line_end;
+            }
+        }
+
+        refs = &pieces[0];
+        n = pieces.size();
+    }
+
+    for (UINT64 done = 0; done < n; ) {
+        UINT64 len = n - done;
+        if (len > batch_len)
+            len = batch_len;
+
+        start_phase(&refs[done], len);
+        done += len;
+    }
+}
+
+VOID PartitionedHierarchy::flush() {
+    // an empty phase gets the L2 requests of the last batch through
+    start_phase(NULL, 0);
+    wait_phases();
+
+    l1->count_splits(l1_splits);
+    l1_splits = 0;
+    for (UINT32 i = 0; i < workers; i++) {
+        level_counts *c = &counts[i].l1;
+        l1->count_accesses(c->reads, c->read_hits, c->writes,
+            c->write_hits);
+        c = &counts[i].l2;
+        l2->count_accesses(c->reads, c->read_hits, c->writes,
+            c->write_hits);
+        l2->count_splits(c->splits);
+        memset(&counts[i].l1, 0, sizeof(level_counts));
+        memset(&counts[i].l2, 0, sizeof(level_counts));
+    }
+}
+
+VOID PartitionedHierarchy::stop() {
+    __sync_synchronize();
+    stopped = true;
+}
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef __ARQSIMUPATTERN_HPP__
+#define __ARQSIMUPATTERN_HPP__
+
+#include "arqsimustack.hpp"
+#include <algorithm>
+#include <functional>
+
+// reuse distances are counted in buckets: 0, 1, 2-3, 4-7, ... and the last
+// one takes everything longer
+#define ARQSIMUPATTERN_BUCKETS 32
+
+// a dominant stride seen in at least this fraction of an instruction's
+// accesses makes it streaming or strided
+#define ARQSIMUPATTERN_CONFIDENT 0.5
+
+// What the accesses of each instruction look like: a histogram of their
+// reuse distances (how many different lines were accessed since the line
+// was last accessed, by any instruction), and the stride between the
+// instruction's consecutive addresses that dominates.
+//
+// Instructions get fixed size records in a table of fixed capacity, so the
+// memory used doesn't depend on the size of the program; accesses of the
+// instructions that don't fit are only counted.
+class AccessPatterns {
+    private:
+        struct pattern {
+            UINT64 accesses;
+            // first accesses to their line
+            UINT64 cold;
+            UINT32 distances[ARQSIMUPATTERN_BUCKETS];
+            ADDRINT last_addr;
+            // majority vote (Boyer and Moore) for the dominant stride:
+            // the candidate, its votes, and how many strides matched it
+            // since it became the candidate
+            INT64 stride;
+            UINT64 votes, matches;
+        };
+
+        UINT64 offset_len;
+        UINT64 time;
+        // last access time of every line, and the access times of every
+        // line in a tree, to count the lines accessed since
+        AddrMap<UINT64> last_access;
+        TimeTree tree;
+        UINT32 root;
+        AddrMap<pattern> patterns;
+        UINT64 untracked;
+
+        UINT64 reuse_distance(ADDRINT addr, bool *cold);
+        VOID vote(pattern *p, ADDRINT addr);
+        string classify(pattern *p, double confidence);
+
+    public:
+        AccessPatterns(UINT64 line_len = 16, UINT64 max_instructions = 65536);
+
+        VOID access(VOID *ip, VOID *addr);
+        // reports the n instructions with the most accesses; names gives
+        // the function and source line of an instruction
+        VOID output(std::ostream *outstream, UINT64 n,
+            string (*names)(ADDRINT ip));
+};
+
+
+//AccessPatterns methods
+AccessPatterns::AccessPatterns(UINT64 line_len, UINT64 max_instructions) :
+    time(0), last_access(1 << 16), root(0),
+    patterns(max_instructions, true), untracked(0) {
+    offset_len = log2((int)line_len);
+}
+
+UINT64 AccessPatterns::reuse_distance(ADDRINT addr, bool *cold) {
+    UINT64 *last = last_access.get(addr >> offset_len);
+    UINT64 last_time = *last;
+    *last = ++time;
+
+    UINT64 distance = 0;
+    *cold = !last_time;
+    if (!*cold) {
+        distance = tree.count_later(root, last_time);
+        root = tree.erase(root, last_time);
+    }
+    root = tree.insert(root, time);
+    return distance;
+}
+
+VOID AccessPatterns::vote(pattern *p, ADDRINT addr) {
+    INT64 stride = addr - p->last_addr;
+    p->last_addr = addr;
+
+    if (p->votes && stride == p->stride) {
+        p->votes++;
+        p->matches++;
+    } else if (p->votes) {
+        p->votes--;
+    } else {
+        p->stride = stride;
+        p->votes = 1;
+        p->matches = 1;
+    }
+}
+
+VOID AccessPatterns::access(VOID *ip, VOID *addr) {
+    bool cold;
+    UINT64 distance = reuse_distance((ADDRINT)addr, &cold);
+
+    pattern *p = patterns.get((UINT64)ip);
+    if (!p) {
+        untracked++;
+        return;
+    }
+
+    if (p->accesses)
+        vote(p, (ADDRINT)addr);
+    else
+        p->last_addr = (ADDRINT)addr;
+    p->accesses++;
+
+    if (cold) {
+        p->cold++;
+    } else {
+        UINT64 bucket = 0;
+        while (distance && bucket + 1 < ARQSIMUPATTERN_BUCKETS) {
+            distance >>= 1;
+            bucket++;
+        }
+        p->distances[bucket]++;
+    }
+}
+
+string AccessPatterns::classify(pattern *p, double confidence) {
+    if (confidence < ARQSIMUPATTERN_CONFIDENT)
+        return "irregular";
+    if (!p->stride)
+        return "constant";
+
+    // strides that stay within a line walk through memory line after line
+    UINT64 stride = p->stride < 0 ? -p->stride : p->stride;
+    return (stride >> offset_len) ? "strided" : "streaming";
+}
+
+VOID AccessPatterns::output(std::ostream *outstream, UINT64 n,
+    string (*names)(ADDRINT ip)) {
+    // instructions by accesses, most first
+    vector< std::pair<UINT64, UINT64> > order;
+    for (UINT64 i = 0; i < patterns.slots(); i++) {
+        if (patterns.key_at(i) != ARQSIMUHASH_EMPTY)
+            order.push_back(std::make_pair(patterns.value_at(i)->accesses, i));
+    }
+    if (n > order.size())
+        n = order.size();
+    std::partial_sort(order.begin(), order.begin() + n, order.end(),
+        std::greater< std::pair<UINT64, UINT64> >());
+
+    *outstream << "=====" << std::endl;
+    *outstream << "access patterns by instruction (top " <<
+        uint_to_string(n) << ", reuse distances in " <<
+        uint_to_string(1 << offset_len) << " byte lines):" << std::endl;
+
+    for (UINT64 i = 0; i < n; i++) {
+        ADDRINT ip = patterns.key_at(order[i].second);
+        pattern *p = patterns.value_at(order[i].second);
+
+        double confidence = 0;
+        if (p->accesses > 1)
+            confidence = p->matches/(double)(p->accesses - 1);
+
+        *outstream << "\t" << hex_to_string(ip) << " " << names(ip) << ": " <<
+            uint_to_string(p->accesses) << " accesses, " <<
+            classify(p, confidence) << ", stride " <<
+            (p->stride < 0 ? "-" : "") << uint_to_string(p->stride < 0 ?
+            -p->stride : p->stride) << " in " <<
+            double_to_string(confidence) << " of them" << std::endl;
+
+        *outstream << "\t\treuse distances: cold " << uint_to_string(p->cold);
+        for (UINT64 bucket = 0; bucket < ARQSIMUPATTERN_BUCKETS; bucket++) {
+            if (!p->distances[bucket])
+                continue;
+
+            *outstream << ", ";
+            if (bucket < 2)
+                *outstream << uint_to_string(bucket);
+            else if (bucket + 1 == ARQSIMUPATTERN_BUCKETS)
+                *outstream << uint_to_string(1ULL << (bucket - 1)) << "+";
+            else
+                *outstream << uint_to_string(1ULL << (bucket - 1)) << "-" <<
+                    uint_to_string((1ULL << bucket) - 1);
+            *outstream << " " << uint_to_string(p->distances[bucket]);
+        }
+        *outstream << std::endl;
+    }
+
+    *outstream << "\taccesses of instructions that didn't fit: " <<
+        uint_to_string(untracked) << std::endl;
+}
+
+#endif
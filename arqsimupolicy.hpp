@@ -0,0 +1,359 @@
+#ifndef __ARQSIMUPOLICY_HPP__
+#define __ARQSIMUPOLICY_HPP__
+
+#include "arqsimucommons.h"
+
+// Per set state of a replacement policy, as a number of fields of a few
+// bits each, packed in 64 bit words. Fields never straddle words, and each
+// set has words of its own, so threads that own different sets never write
+// the same word.
+class PackedState {
+    private:
+        UINT64 bits, fields_per_word, words_per_set, field_mask;
+        vector<UINT64> words;
+
+    public:
+        PackedState(UINT64 sets = 0, UINT64 fields = 1, UINT64 pbits = 1,
+            UINT64 initial = 0);
+
+        UINT64 get(UINT64 set, UINT64 field);
+        VOID put(UINT64 set, UINT64 field, UINT64 value);
+};
+
+// Decides which line of a full set is replaced. Caches tell it about every
+// hit and every line they load, and only ask for a victim when the set has
+// no free way.
+class ReplacementPolicy {
+    public:
+        virtual ~ReplacementPolicy() {}
+
+        virtual string get_name() = 0;
+        // the line in way was hit
+        virtual VOID touch(UINT64 index, UINT32 way) = 0;
+        // a line was just loaded into way
+        virtual VOID insert(UINT64 index, UINT32 way) = 0;
+        virtual UINT32 victim(UINT64 index) = 0;
+};
+
+// Lines are replaced in the order they were loaded, hits don't matter
+class FifoPolicy : public ReplacementPolicy {
+    private:
+        UINT64 ways;
+        // the way that will be replaced next
+        PackedState next_victim;
+
+    public:
+        FifoPolicy(UINT64 sets = 0, UINT64 pways = 1);
+
+        virtual string get_name();
+        virtual VOID touch(UINT64 index, UINT32 way);
+        virtual VOID insert(UINT64 index, UINT32 way);
+        virtual UINT32 victim(UINT64 index);
+};
+
+// True LRU: every line has an age, 0 for the most recently used and ways-1
+// for the one to replace
+class LruPolicy : public ReplacementPolicy {
+    private:
+        UINT64 ways;
+        PackedState ages;
+
+    public:
+        LruPolicy(UINT64 sets = 0, UINT64 pways = 1);
+
+        virtual string get_name();
+        virtual VOID touch(UINT64 index, UINT32 way);
+        virtual VOID insert(UINT64 index, UINT32 way);
+        virtual UINT32 victim(UINT64 index);
+};
+
+// Tree pseudo-LRU: a binary tree over the ways with one bit per inner node
+// pointing to the half that was used less recently (0 left, 1 right). When
+// the ways are not a power of 2, the tree is as large as the next one and
+// the missing leaves are never picked.
+class TreePlruPolicy : public ReplacementPolicy {
+    private:
+        UINT64 ways, leaves;
+        // node n of the tree, counting from 1 at the root, is field n-1
+        PackedState nodes;
+
+    public:
+        TreePlruPolicy(UINT64 sets = 0, UINT64 pways = 1);
+
+        virtual string get_name();
+        virtual VOID touch(UINT64 index, UINT32 way);
+        virtual VOID insert(UINT64 index, UINT32 way);
+        virtual UINT32 victim(UINT64 index);
+};
+
+// Re-reference interval prediction (Jaleel et al.) with 2 bit predictions:
+// hits predict a near re-reference (0), and the victim is a line predicted
+// distant (3), aging every line until there is one. SRRIP loads lines with
+// a long prediction (2); BRRIP loads them distant, and long only once in a
+// while, so that lines used once don't push out the working set.
+class RripPolicy : public ReplacementPolicy {
+    private:
+        UINT64 ways;
+        bool bimodal;
+        PackedState predictions;
+        PackedState seeds;
+
+    public:
+        RripPolicy(UINT64 sets = 0, UINT64 pways = 1, bool pbimodal = false);
+
+        virtual string get_name();
+        virtual VOID touch(UINT64 index, UINT32 way);
+        virtual VOID insert(UINT64 index, UINT32 way);
+        virtual UINT32 victim(UINT64 index);
+};
+
+// Any line may be replaced. Each set draws from its own generator, so the
+// choices don't depend on how accesses to different sets interleave.
+class RandomPolicy : public ReplacementPolicy {
+    private:
+        UINT64 ways;
+        PackedState seeds;
+
+    public:
+        RandomPolicy(UINT64 sets = 0, UINT64 pways = 1);
+
+        virtual string get_name();
+        virtual VOID touch(UINT64 index, UINT32 way);
+        virtual VOID insert(UINT64 index, UINT32 way);
+        virtual UINT32 victim(UINT64 index);
+};
+
+// Builds the policy called name (fifo, lru, plru, srrip, brrip or random)
+// for a cache with the given geometry, or returns NULL if there's no such
+// policy
+ReplacementPolicy *make_replacement_policy(string name, UINT64 sets,
+    UINT64 ways);
+bool is_replacement_policy(string name);
+// whether the policy called name changes its state when the line hit or
+// loaded last is hit again (RRIP only predicts a near re-reference on a
+// hit), in which case such hits can't be resolved without the cache
+bool repeated_hits_matter(string name);
+
+
+// bits needed to store a number in 0..n-1
+static UINT64 bits_for(UINT64 n) {
+    UINT64 bits = 1;
+    while ((1ULL << bits) < n)
+        bits++;
+    return bits;
+}
+
+// next value of the xorshift generator of a set
+static UINT32 next_random(PackedState *seeds, UINT64 index) {
+    UINT32 seed = seeds->get(index, 0);
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    seeds->put(index, 0, seed);
+    return seed;
+}
+
+#define ARQSIMUPOLICY_SEED 2463534242U
+
+
+//PackedState methods
+PackedState::PackedState(UINT64 sets, UINT64 fields, UINT64 pbits,
+    UINT64 initial) : bits(pbits) {
+    fields_per_word = 64/bits;
+    words_per_set = (fields + fields_per_word - 1)/fields_per_word;
+    field_mask = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+    words.assign(sets*words_per_set, 0);
+
+    for (UINT64 set = 0; set < sets; set++) {
+        for (UINT64 field = 0; field < fields; field++)
+            put(set, field, initial);
+    }
+}
+
+UINT64 PackedState::get(UINT64 set, UINT64 field) {
+    UINT64 word = words[set*words_per_set + field/fields_per_word];
+    return (word >> (field % fields_per_word)*bits) & field_mask;
+}
+
+VOID PackedState::put(UINT64 set, UINT64 field, UINT64 value) {
+    UINT64 *word = &words[set*words_per_set + field/fields_per_word];
+    UINT64 shift = (field % fields_per_word)*bits;
+    *word = (*word & ~(field_mask << shift)) | ((value & field_mask) << shift);
+}
+
+
+//FifoPolicy methods
+FifoPolicy::FifoPolicy(UINT64 sets, UINT64 pways) : ways(pways),
+    next_victim(sets, 1, bits_for(pways)) {}
+
+string FifoPolicy::get_name() {
+    return "fifo";
+}
+
+VOID FifoPolicy::touch(UINT64 index, UINT32 way) {}
+
+VOID FifoPolicy::insert(UINT64 index, UINT32 way) {}
+
+UINT32 FifoPolicy::victim(UINT64 index) {
+    // ways are filled in order, so the oldest line is always the next one
+    UINT32 way = next_victim.get(index, 0);
+    next_victim.put(index, 0, (way + 1 == ways) ? 0 : way + 1);
+    return way;
+}
+
+
+//LruPolicy methods
+LruPolicy::LruPolicy(UINT64 sets, UINT64 pways) : ways(pways),
+    ages(sets, pways, bits_for(pways)) {
+    // until the first hit, ways are replaced in order
+    for (UINT64 set = 0; set < sets; set++) {
+        for (UINT64 way = 0; way < ways; way++)
+            ages.put(set, way, ways - 1 - way);
+    }
+}
+
+string LruPolicy::get_name() {
+    return "lru";
+}
+
+VOID LruPolicy::touch(UINT64 index, UINT32 way) {
+    UINT64 age = ages.get(index, way);
+    for (UINT64 other = 0; other < ways; other++) {
+        UINT64 other_age = ages.get(index, other);
+        if (other_age < age)
+            ages.put(index, other, other_age + 1);
+    }
+    ages.put(index, way, 0);
+}
+
+VOID LruPolicy::insert(UINT64 index, UINT32 way) {
+    touch(index, way);
+}
+
+UINT32 LruPolicy::victim(UINT64 index) {
+    for (UINT32 way = 0; way < ways; way++) {
+        if (ages.get(index, way) == ways - 1)
+            return way;
+    }
+    return 0;
+}
+
+
+//TreePlruPolicy methods
+TreePlruPolicy::TreePlruPolicy(UINT64 sets, UINT64 pways) : ways(pways),
+    leaves(1ULL << bits_for(pways)), nodes(sets, leaves - 1, 1) {}
+
+string TreePlruPolicy::get_name() {
+    return "plru";
+}
+
+VOID TreePlruPolicy::touch(UINT64 index, UINT32 way) {
+    // every node on the way down to the leaf points away from it
+    UINT64 node = 1, first = 0, half = leaves/2;
+    for (; half; half /= 2) {
+        bool right = (way >= first + half);
+        nodes.put(index, node - 1, !right);
+        node = 2*node + right;
+        if (right)
+            first += half;
+    }
+}
+
+VOID TreePlruPolicy::insert(UINT64 index, UINT32 way) {
+    touch(index, way);
+}
+
+UINT32 TreePlruPolicy::victim(UINT64 index) {
+    UINT64 node = 1, first = 0, half = leaves/2;
+    for (; half; half /= 2) {
+        bool right = nodes.get(index, node - 1) && first + half < ways;
+        node = 2*node + right;
+        if (right)
+            first += half;
+    }
+    return first;
+}
+
+
+//RripPolicy methods
+#define ARQSIMUPOLICY_RRIP_DISTANT 3
+#define ARQSIMUPOLICY_RRIP_LONG 2
+// BRRIP loads one in this many lines with a long prediction
+#define ARQSIMUPOLICY_BRRIP_LONG_ODDS 32
+
+RripPolicy::RripPolicy(UINT64 sets, UINT64 pways, bool pbimodal) :
+    ways(pways), bimodal(pbimodal),
+    predictions(sets, pways, 2, ARQSIMUPOLICY_RRIP_DISTANT),
+    seeds(sets, 1, 32, ARQSIMUPOLICY_SEED) {}
+
+string RripPolicy::get_name() {
+    return bimodal ? "brrip" : "srrip";
+}
+
+VOID RripPolicy::touch(UINT64 index, UINT32 way) {
+    predictions.put(index, way, 0);
+}
+
+VOID RripPolicy::insert(UINT64 index, UINT32 way) {
+    UINT64 prediction = ARQSIMUPOLICY_RRIP_LONG;
+    if (bimodal && next_random(&seeds, index) % ARQSIMUPOLICY_BRRIP_LONG_ODDS)
+        prediction = ARQSIMUPOLICY_RRIP_DISTANT;
+    predictions.put(index, way, prediction);
+}
+
+UINT32 RripPolicy::victim(UINT64 index) {
+    for (;;) {
+        for (UINT32 way = 0; way < ways; way++) {
+            if (predictions.get(index, way) == ARQSIMUPOLICY_RRIP_DISTANT)
+                return way;
+        }
+        for (UINT32 way = 0; way < ways; way++)
+            predictions.put(index, way, predictions.get(index, way) + 1);
+    }
+}
+
+
+//RandomPolicy methods
+RandomPolicy::RandomPolicy(UINT64 sets, UINT64 pways) : ways(pways),
+    seeds(sets, 1, 32, ARQSIMUPOLICY_SEED) {}
+
+string RandomPolicy::get_name() {
+    return "random";
+}
+
+VOID RandomPolicy::touch(UINT64 index, UINT32 way) {}
+
+VOID RandomPolicy::insert(UINT64 index, UINT32 way) {}
+
+UINT32 RandomPolicy::victim(UINT64 index) {
+    return next_random(&seeds, index) % ways;
+}
+
+
+ReplacementPolicy *make_replacement_policy(string name, UINT64 sets,
+    UINT64 ways) {
+    if (name == "fifo")
+        return new FifoPolicy(sets, ways);
+    else if (name == "lru")
+        return new LruPolicy(sets, ways);
+    else if (name == "plru")
+        return new TreePlruPolicy(sets, ways);
+    else if (name == "srrip")
+        return new RripPolicy(sets, ways, false);
+    else if (name == "brrip")
+        return new RripPolicy(sets, ways, true);
+    else if (name == "random")
+        return new RandomPolicy(sets, ways);
+    return NULL;
+}
+
+bool is_replacement_policy(string name) {
+    return name == "fifo" || name == "lru" || name == "plru" ||
+        name == "srrip" || name == "brrip" || name == "random";
+}
+
+bool repeated_hits_matter(string name) {
+    return name == "srrip" || name == "brrip";
+}
+
+#endif
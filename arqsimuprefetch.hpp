@@ -0,0 +1,260 @@
+#ifndef __ARQSIMUPREFETCH_HPP__
+#define __ARQSIMUPREFETCH_HPP__
+
+#include "arqsimucommons.h"
+
+// most lines a prefetcher asks for after a single access
+#define ARQSIMUPREFETCH_MAX_DEGREE 16
+
+// Watches the demand accesses to a cache level and decides which lines to
+// load before they are asked for. The cache does the loading, through the
+// next level's read() like any miss.
+class Prefetcher {
+    protected:
+        UINT64 line_len, degree;
+
+    public:
+        Prefetcher(UINT64 pline_len = 16, UINT64 pdegree = 1);
+        virtual ~Prefetcher() {}
+
+        virtual string get_name() = 0;
+        UINT64 get_degree();
+        // sees an access (ip is NULL if the level doesn't know it) and
+        // whether it missed or was the first hit to a prefetched line, and
+        // writes up to degree addresses to prefetch; returns how many
+        virtual UINT32 observe(VOID *ip, VOID *addr, bool miss,
+            bool prefetch_hit, VOID **prefetches) = 0;
+};
+
+// Tagged next line prefetching: a miss, or the first use of a prefetched
+// line, loads the lines that follow it
+class NextLinePrefetcher : public Prefetcher {
+    public:
+        NextLinePrefetcher(UINT64 pline_len = 16, UINT64 pdegree = 1);
+
+        virtual string get_name();
+        virtual UINT32 observe(VOID *ip, VOID *addr, bool miss,
+            bool prefetch_hit, VOID **prefetches);
+};
+
+// Reference prediction table (Chen and Baer): a direct mapped table, by
+// instruction, of the last address accessed and the stride between the
+// last two. Once the same stride repeats, the next strides are prefetched.
+class StridePrefetcher : public Prefetcher {
+    private:
+        struct entry {
+            VOID *ip;
+            ADDRINT last_addr;
+            INT64 stride;
+            // saturates at 3, prefetches from 2 up
+            UINT32 confidence;
+        };
+        vector<entry> table;
+
+    public:
+        StridePrefetcher(UINT64 pline_len = 16, UINT64 pdegree = 1,
+            UINT64 entries = 256);
+
+        virtual string get_name();
+        virtual UINT32 observe(VOID *ip, VOID *addr, bool miss,
+            bool prefetch_hit, VOID **prefetches);
+};
+
+// Tracks a few streams of misses moving through memory in one direction
+// within a window of lines. Once a stream has moved the same way twice, the
+// lines ahead of it are prefetched. Streams are replaced least recently
+// used first.
+class StreamPrefetcher : public Prefetcher {
+    private:
+        struct stream {
+            ADDRINT last_line;
+            INT64 direction;
+            UINT32 confidence;
+            UINT64 last_use;
+        };
+        vector<stream> streams;
+        UINT64 window, uses;
+
+    public:
+        StreamPrefetcher(UINT64 pline_len = 16, UINT64 pdegree = 1,
+            UINT64 nstreams = 16, UINT64 pwindow = 16);
+
+        virtual string get_name();
+        virtual UINT32 observe(VOID *ip, VOID *addr, bool miss,
+            bool prefetch_hit, VOID **prefetches);
+};
+
+// Builds the prefetcher called name (next_line, stride or stream) for a
+// cache with lines of line_len bytes, or returns NULL if there's no such
+// prefetcher
+Prefetcher *make_prefetcher(string name, UINT64 line_len, UINT64 degree);
+bool is_prefetcher(string name);
+
+
+// absolute value of a difference between addresses
+static UINT64 address_distance(INT64 difference) {
+    return difference < 0 ? -difference : difference;
+}
+
+
+//Prefetcher methods
+Prefetcher::Prefetcher(UINT64 pline_len, UINT64 pdegree) :
+    line_len(pline_len), degree(pdegree) {
+    if (degree > ARQSIMUPREFETCH_MAX_DEGREE)
+        degree = ARQSIMUPREFETCH_MAX_DEGREE;
+}
+
+UINT64 Prefetcher::get_degree() {
+    return degree;
+}
+
+
+//NextLinePrefetcher methods
+NextLinePrefetcher::NextLinePrefetcher(UINT64 pline_len, UINT64 pdegree) :
+    Prefetcher(pline_len, pdegree) {}
+
+string NextLinePrefetcher::get_name() {
+    return "next_line";
+}
+
+UINT32 NextLinePrefetcher::observe(VOID *ip, VOID *addr, bool miss,
+    bool prefetch_hit, VOID **prefetches) {
+    if (!miss && !prefetch_hit)
+        return 0;
+
+    ADDRINT line = (ADDRINT)addr & ~(line_len - 1);
+    for (UINT32 i = 0; i < degree; i++)
+        prefetches[i] = (VOID *)(line + (i + 1)*line_len);
+    return degree;
+}
+
+
+//StridePrefetcher methods
+StridePrefetcher::StridePrefetcher(UINT64 pline_len, UINT64 pdegree,
+    UINT64 entries) : Prefetcher(pline_len, pdegree), table(entries) {
+    for (UINT64 i = 0; i < entries; i++) {
+        table[i].ip = NULL;
+        table[i].last_addr = 0;
+        table[i].stride = 0;
+        table[i].confidence = 0;
+    }
+}
+
+string StridePrefetcher::get_name() {
+    return "stride";
+}
+
+UINT32 StridePrefetcher::observe(VOID *ip, VOID *addr, bool miss,
+    bool prefetch_hit, VOID **prefetches) {
+    // prefetches and write backs from the level above have no instruction
+    if (!ip)
+        return 0;
+
+    entry *e = &table[((ADDRINT)ip >> 2) % table.size()];
+    if (e->ip != ip) {
+        e->ip = ip;
+        e->last_addr = (ADDRINT)addr;
+        e->stride = 0;
+        e->confidence = 0;
+        return 0;
+    }
+
+    INT64 stride = (ADDRINT)addr - e->last_addr;
+    e->last_addr = (ADDRINT)addr;
+    if (stride == e->stride) {
+        if (e->confidence < 3)
+            e->confidence++;
+    } else if (e->confidence > 0) {
+        e->confidence--;
+    } else {
+        e->stride = stride;
+    }
+
+    // strides within a line keep hitting it, there's nothing to load
+    if (e->confidence < 2 || address_distance(e->stride) < line_len)
+        return 0;
+
+    for (UINT32 i = 0; i < degree; i++)
+        prefetches[i] = (VOID *)((ADDRINT)addr + (i + 1)*e->stride);
+    return degree;
+}
+
+
+//StreamPrefetcher methods
+StreamPrefetcher::StreamPrefetcher(UINT64 pline_len, UINT64 pdegree,
+    UINT64 nstreams, UINT64 pwindow) : Prefetcher(pline_len, pdegree),
+    streams(nstreams), window(pwindow), uses(0) {
+    for (UINT64 i = 0; i < nstreams; i++) {
+        streams[i].last_line = 0;
+        streams[i].direction = 0;
+        streams[i].confidence = 0;
+        streams[i].last_use = 0;
+    }
+}
+
+string StreamPrefetcher::get_name() {
+    return "stream";
+}
+
+UINT32 StreamPrefetcher::observe(VOID *ip, VOID *addr, bool miss,
+    bool prefetch_hit, VOID **prefetches) {
+    if (!miss && !prefetch_hit)
+        return 0;
+
+    ADDRINT line = (ADDRINT)addr / line_len;
+    uses++;
+
+    stream *match = NULL, *oldest = &streams[0];
+    for (UINT64 i = 0; i < streams.size(); i++) {
+        stream *s = &streams[i];
+        if (s->last_use && line != s->last_line &&
+            address_distance(line - s->last_line) <= window) {
+            match = s;
+            break;
+        }
+        if (s->last_use < oldest->last_use)
+            oldest = s;
+    }
+
+    if (!match) {
+        oldest->last_line = line;
+        oldest->direction = 0;
+        oldest->confidence = 0;
+        oldest->last_use = uses;
+        return 0;
+    }
+
+    INT64 direction = (line > match->last_line) ? 1 : -1;
+    if (direction == match->direction) {
+        match->confidence++;
+    } else {
+        match->direction = direction;
+        match->confidence = 1;
+    }
+    match->last_line = line;
+    match->last_use = uses;
+
+    if (match->confidence < 2)
+        return 0;
+
+    for (UINT32 i = 0; i < degree; i++)
+        prefetches[i] = (VOID *)((line + (i + 1)*direction)*line_len);
+    return degree;
+}
+
+
+Prefetcher *make_prefetcher(string name, UINT64 line_len, UINT64 degree) {
+    if (name == "next_line")
+        return new NextLinePrefetcher(line_len, degree);
+    else if (name == "stride")
+        return new StridePrefetcher(line_len, degree);
+    else if (name == "stream")
+        return new StreamPrefetcher(line_len, degree);
+    return NULL;
+}
+
+bool is_prefetcher(string name) {
+    return name == "next_line" || name == "stride" || name == "stream";
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include "arqsimutrace.h"
+
+
+static KNOB<string> knob_trace(KNOB_MODE_WRITEONCE, "pintool", "o",
+    "arqsimurecord.trace", "file where the trace is written");
+static KNOB<UINT32> knob_buffer_pages(KNOB_MODE_WRITEONCE, "pintool",
+    "buffer_pages", "256", "size of each thread's trace buffer in pages");
+
+static std::ofstream outfile;
+static TraceWriter writer;
+static BUFFER_ID buffer_id;
+// threads share the trace, so whole buffers are written at a time
+static PIN_LOCK writer_lock;
+
+static VOID *write_buffer(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt,
+    VOID *buf, UINT64 elements, VOID *v) {
+    trace_record *records = (trace_record *)buf;
+
+    PIN_GetLock(&writer_lock, tid + 1);
+    for (UINT64 i = 0; i < elements; i++) {
+        // IARG_BRANCH_TAKEN only fills the low byte of size
+        if (records[i].kind == ARQSIMUTRACE_BRANCH)
+            records[i].size &= 0xFF;
+        writer.write(records[i]);
+    }
+    PIN_ReleaseLock(&writer_lock);
+
+    return buf;
+}
+
+static VOID record_memop(INS ins, UINT32 memop, UINT32 kind) {
+    INS_InsertFillBufferPredicated(ins, IPOINT_BEFORE, buffer_id,
+        IARG_UINT32, kind, offsetof(trace_record, kind),
+        IARG_UINT32, INS_MemoryOperandSize(ins, memop),
+        offsetof(trace_record, size),
+        IARG_INST_PTR, offsetof(trace_record, ip),
+        IARG_MEMORYOP_EA, memop, offsetof(trace_record, addr),
+        IARG_END);
+}
+
+static VOID instrument_instruction(INS ins, VOID *v) {
+    UINT32 memops = INS_MemoryOperandCount(ins);
+
+    for (UINT32 memop = 0; memop < memops; memop++) {
+        if (INS_MemoryOperandIsRead(ins, memop))
+            record_memop(ins, memop, ARQSIMUTRACE_READ);
+        if (INS_MemoryOperandIsWritten(ins, memop))
+            record_memop(ins, memop, ARQSIMUTRACE_WRITE);
+    }
+
+    // conditional branches, as arqsimujumps sees them
+    if (INS_IsBranchOrCall(ins) && INS_HasFallThrough(ins)) {
+        INS_InsertFillBufferPredicated(ins, IPOINT_BEFORE, buffer_id,
+            IARG_UINT32, ARQSIMUTRACE_BRANCH, offsetof(trace_record, kind),
+            IARG_BRANCH_TAKEN, offsetof(trace_record, size),
+            IARG_INST_PTR, offsetof(trace_record, ip),
+            IARG_BRANCH_TARGET_ADDR, offsetof(trace_record, addr),
+            IARG_END);
+    }
+}
+
+static VOID finalize(INT32 code, VOID *v) {
+    bool written = writer.close();
+
+    outfile << "=====" << std::endl;
+    outfile << "trace " << knob_trace.Value() << ":" << std::endl;
+    outfile << "\trecords: " << uint_to_string(writer.get_records()) <<
+        std::endl;
+    // a full disk, say; what made it to the file is cut off somewhere
+    if (!written)
+        outfile << "\terror: the trace couldn't be written whole" <<
+            std::endl;
+    outfile.close();
+}
+
+static INT32 usage() {
+    PIN_ERROR("This Pintool records a trace of memory references and "
+        "conditional branches\n" + KNOB_BASE::StringKnobSummary() + "\n");
+    return -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+
+    if (PIN_Init(argc, argv))
+        return usage();
+
+
+    outfile.open("arqsimurecord.out");
+
+    if (!writer.open(knob_trace.Value()))
+        return usage();
+
+    PIN_InitLock(&writer_lock);
+    buffer_id = PIN_DefineTraceBuffer(sizeof(trace_record),
+        knob_buffer_pages, write_buffer, 0);
+    if (buffer_id == BUFFER_ID_INVALID)
+        return usage();
+
+    INS_AddInstrumentFunction(instrument_instruction, 0);
+    PIN_AddFiniFunction(finalize, 0);
+
+    // start program and never return
+    PIN_StartProgram();
+
+    return 0;
+}
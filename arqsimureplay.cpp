@@ -0,0 +1,167 @@
+// Replays a trace written by arqsimurecord through the cache hierarchy of
+// arqsimucache and the predictors of arqsimujumps. It doesn't need Pin:
+//
+//     g++ -O2 -DARQSIMU_NO_PIN -o arqsimureplay arqsimureplay.cpp
+//     ./arqsimureplay [-l1_size 65536] [-l1_ways 2] ... arqsimurecord.trace
+#include <stdlib.h>
+#include "arqsimutrace.h"
+#include "arqsimuhierarchy.hpp"
+#include "arqsimujumps.hpp"
+
+
+// options, named and defaulting like the knobs of arqsimucache
+struct replay_options {
+    string trace;
+    UINT64 l1_size, l1_ways, l1_line_len;
+    UINT64 l2_size, l2_ways, l2_line_len;
+    string l1_policy, l2_policy;
+};
+
+static std::ofstream outfile;
+
+static int usage() {
+    std::cerr << "usage: arqsimureplay [-l1_size n] [-l1_ways n] "
+        "[-l1_line_len n] [-l1_policy p] [-l2_size n] [-l2_ways n] "
+        "[-l2_line_len n] [-l2_policy p] trace" << std::endl;
+    return 1;
+}
+
+static bool parse_options(int argc, char *argv[], replay_options *options) {
+    options->l1_size = 64*1024;
+    options->l1_ways = 2;
+    options->l1_line_len = 16;
+    options->l2_size = 1000*1024;
+    options->l2_ways = 2;
+    options->l2_line_len = 16;
+    options->l1_policy = "fifo";
+    options->l2_policy = "fifo";
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg[0] != '-') {
+            options->trace = arg;
+            continue;
+        }
+
+        if (i + 1 == argc)
+            return false;
+        string text = argv[++i];
+        UINT64 value = strtoull(text.c_str(), NULL, 0);
+
+        if (arg == "-l1_policy" && is_replacement_policy(text))
+            options->l1_policy = text;
+        else if (arg == "-l2_policy" && is_replacement_policy(text))
+            options->l2_policy = text;
+        else if (arg == "-l1_size")
+            options->l1_size = value;
+        else if (arg == "-l1_ways")
+            options->l1_ways = value;
+        else if (arg == "-l1_line_len")
+            options->l1_line_len = value;
+        else if (arg == "-l2_size")
+            options->l2_size = value;
+        else if (arg == "-l2_ways")
+            options->l2_ways = value;
+        else if (arg == "-l2_line_len")
+            options->l2_line_len = value;
+        else
+            return false;
+    }
+
+    return !options->trace.empty();
+}
+
+int main(int argc, char *argv[])
+{
+    replay_options options;
+    if (!parse_options(argc, argv, &options))
+        return usage();
+
+    TraceReader reader;
+    if (!reader.open(options.trace)) {
+        std::cerr << "arqsimureplay: can't read trace " << options.trace <<
+            std::endl;
+        return 1;
+    }
+
+    outfile.open("arqsimureplay.out");
+    double start_time = wall_time();
+
+    Memory *front_memory = make_hierarchy(options.l1_size, options.l1_ways,
+        options.l1_line_len, options.l2_size, options.l2_ways,
+        options.l2_line_len, options.l1_policy, options.l2_policy);
+
+    list<Predictor*> predictors;
+    predictors.push_back(new AlwaysJumpPredictor());
+    predictors.push_back(new NeverJumpPredictor());
+    predictors.push_back(new JumpIfTargetIsLowerPredictor());
+    predictors.push_back(new OneBitHistoryPredictor());
+    predictors.push_back(new TwoBitSaturationHistoryPredictor());
+    predictors.push_back(new TwoBitHysteresisHistoryPredictor());
+
+    // same filter as arqsimucache: repeating an access to the last line is
+    // an L1 hit that only changes the counters (unless the L1 policy cares)
+    bool use_filter = !repeated_hits_matter(options.l1_policy);
+    UINT64 offset_len = log2((int)options.l1_line_len);
+    ADDRINT last_line = ARQSIMUCACHE_NOTAG;
+    ADDRINT last_dirty_line = ARQSIMUCACHE_NOTAG;
+    UINT64 read_hits = 0, write_hits = 0, records = 0;
+
+    trace_record record;
+    while (reader.next(&record)) {
+        records++;
+
+        if (record.kind == ARQSIMUTRACE_BRANCH) {
+            list<Predictor*>::iterator it;
+            for (it = predictors.begin(); it != predictors.end(); it++) {
+                (*it)->analyze((VOID *)record.ip, (VOID *)record.addr,
+                    record.size);
+            }
+            continue;
+        }
+
+        // accesses that end in another line always go to the hierarchy
+        ADDRINT line = record.addr >> offset_len;
+        bool one_line = ((record.addr + record.size - 1) >> offset_len) == line;
+        if (record.kind == ARQSIMUTRACE_WRITE) {
+            if (use_filter && one_line && line == last_dirty_line) {
+                write_hits++;
+                continue;
+            }
+            front_memory->write((VOID *)record.addr, NULL, record.size);
+            last_line = last_dirty_line = line;
+        } else {
+            if (use_filter && one_line && line == last_line) {
+                read_hits++;
+                continue;
+            }
+            front_memory->read((VOID *)record.addr, NULL, record.size);
+            last_line = line;
+            last_dirty_line = ARQSIMUCACHE_NOTAG;
+        }
+    }
+    reader.close();
+    if (reader.is_corrupt()) {
+        std::cerr << "arqsimureplay: trace " << options.trace <<
+            " is cut off or corrupt after " << uint_to_string(records) <<
+            " records" << std::endl;
+        return 1;
+    }
+
+    front_memory->count_hits(read_hits, write_hits);
+    front_memory->output(&outfile);
+
+    list<Predictor*>::iterator it;
+    for (it = predictors.begin(); it != predictors.end(); it++)
+        (*it)->output(&outfile);
+
+    double elapsed = wall_time() - start_time;
+    outfile << "=====" << std::endl;
+    outfile << "throughput (replay):" << std::endl;
+    outfile << "\trecords/wall time: " << uint_to_string(records) << " / " <<
+        double_to_string(elapsed) << " s = " <<
+        double_to_string(records/elapsed) << std::endl;
+
+    outfile.close();
+    return 0;
+}
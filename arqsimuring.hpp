@@ -0,0 +1,126 @@
+#ifndef __ARQSIMURING_HPP__
+#define __ARQSIMURING_HPP__
+
+#include "arqsimucache.hpp"
+
+// Ring of memref batches with one producer and a fixed set of consumers,
+// every one of which sees every batch (each consumer simulates its own
+// hierarchy over the same reference stream).
+//
+// The producer publishes a batch by advancing head, and a consumer releases
+// it by advancing its own tail; a slot is reused once every tail has passed
+// it. Nothing is locked: each counter has a single writer, and the other
+// side only reads it.
+class BatchRing {
+    private:
+        // counters written by different threads live in different host
+        // cache lines
+        struct counter {
+            volatile UINT64 value;
+            UINT8 padding[56];
+        };
+
+        UINT64 slots, batch_len;
+        vector<memref> refs;
+        vector<UINT64> lengths;
+        counter head;
+        vector<counter> tails;
+        volatile bool closed;
+
+        UINT64 oldest_tail();
+
+    public:
+        BatchRing(UINT64 pslots = 16, UINT64 pbatch_len = 4096,
+            UINT32 consumers = 1);
+
+        UINT64 get_batch_len();
+
+        // producer side: returns the slot to fill next, waiting until every
+        // consumer is done with it, and publishes it with n references
+        memref *next_slot();
+        VOID publish(UINT64 n);
+        // no more batches will be published
+        VOID close();
+        bool is_closed();
+
+        // consumer side: waits for the next batch, returns false once the
+        // ring is closed and every batch has been seen
+        bool wait_batch(UINT32 consumer, memref **batch, UINT64 *n);
+        VOID release(UINT32 consumer);
+};
+
+
+//BatchRing methods
+BatchRing::BatchRing(UINT64 pslots, UINT64 pbatch_len, UINT32 consumers) :
+    slots(pslots), batch_len(pbatch_len), refs(pslots*pbatch_len),
+    lengths(pslots, 0), tails(consumers), closed(false) {
+    head.value = 0;
+    for (UINT32 i = 0; i < consumers; i++)
+        tails[i].value = 0;
+}
+
+UINT64 BatchRing::get_batch_len() {
+    return batch_len;
+}
+
+UINT64 BatchRing::oldest_tail() {
+    UINT64 oldest = head.value;
+    for (UINT32 i = 0; i < tails.size(); i++) {
+        if (tails[i].value < oldest)
+            oldest = tails[i].value;
+    }
+    return oldest;
+}
+
+memref *BatchRing::next_slot() {
+    while (head.value - oldest_tail() == slots)
+        ARQSIMU_YIELD();
+
+    // don't let the writes to the slot move before the check
+    __sync_synchronize();
+    return &refs[(head.value % slots)*batch_len];
+}
+
+VOID BatchRing::publish(UINT64 n) {
+    lengths[head.value % slots] = n;
+    // the batch must be complete before consumers can see it
+    __sync_synchronize();
+    head.value++;
+}
+
+VOID BatchRing::close() {
+    __sync_synchronize();
+    closed = true;
+}
+
+bool BatchRing::is_closed() {
+    return closed;
+}
+
+bool BatchRing::wait_batch(UINT32 consumer, memref **batch, UINT64 *n) {
+    UINT64 tail = tails[consumer].value;
+
+    while (tail == head.value) {
+        if (closed) {
+            // a batch may have been published right before closing
+            __sync_synchronize();
+            if (tail == head.value)
+                return false;
+            break;
+        }
+        ARQSIMU_YIELD();
+    }
+
+    __sync_synchronize();
+    *batch = &refs[(tail % slots)*batch_len];
+    *n = lengths[tail % slots];
+    return true;
+}
+
+VOID BatchRing::release(UINT32 consumer) {
+    // done reading the slot before the producer can reuse it
+    __sync_synchronize();
+    tails[consumer].value++;
+}
+
+#endif
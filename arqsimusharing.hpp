@@ -0,0 +1,325 @@
+#ifndef __ARQSIMUSHARING_HPP__
+#define __ARQSIMUSHARING_HPP__
+
+#include <algorithm>
+#include "arqsimucache.hpp"
+
+// instructions kept for each line, the ones involved the most
+#define ARQSIMUSHARING_IPS 4
+// site of the lines that no allocation site is known for
+#define ARQSIMUSHARING_NO_SITE 0xFFFFFFFF
+
+// Tells true from false sharing among the coherence misses of private
+// caches. Each core's writes to a line are known by the bytes they wrote
+// (one bit per chunk of chunk_len bytes; lines have at most 64 chunks),
+// and when the line is handed off to other cores they become unseen bytes
+// of the cores that lost the line to an invalidation. The coherence miss
+// of such a core is true sharing if it accesses unseen bytes, which it had
+// to get from the other core, and false sharing if it only accesses other
+// bytes of the line, which it lost for nothing.
+//
+// Only lines that a core took from another one are tracked, by invalidating
+// its copy or by getting what it wrote, and their records only keep the
+// cores involved. Records are split in shards, and each shard is only
+// touched by one thread at a time (the caller's directory stripes), so
+// tracking takes no locks of its own.
+class SharingDetector {
+    private:
+        struct ip_count {
+            ADDRINT ip;
+            UINT64 count;
+        };
+        struct core_bytes {
+            UINT32 core;
+            // bytes it wrote, and bytes written by others since it lost
+            // the line
+            UINT64 written, unseen;
+        };
+        struct line_record {
+            UINT32 site;
+            // the cores that wrote it or lost it, by core number
+            vector<core_bytes> cores;
+            UINT64 true_sharing, false_sharing, invalidations;
+            // instructions that missed on the line or invalidated it
+            ip_count ips[ARQSIMUSHARING_IPS];
+        };
+        struct shard {
+            AddrMap<line_record *> lines;
+            shard();
+        };
+        // a tracked line, when they're sorted for the report
+        struct shared_line {
+            UINT64 misses;
+            ADDRINT line;
+            line_record *record;
+        };
+
+        UINT64 line_len, offset_len, chunk_len;
+        vector<shard> shards;
+        // allocation site of an address, if they're known
+        UINT32 (*find_site)(ADDRINT addr);
+
+        line_record *find(UINT32 shard_id, ADDRINT line);
+        // same, but starts tracking line if it isn't
+        line_record *track(UINT32 shard_id, ADDRINT line);
+        core_bytes *find_core(line_record *record, UINT32 core);
+        core_bytes *add_core(line_record *record, UINT32 core);
+        VOID add_written(line_record *record, UINT32 core, UINT64 written,
+            UINT64 lost);
+        VOID count_ip(line_record *record, ADDRINT ip);
+        string byte_ranges(UINT64 chunks);
+        static bool more_misses(const shared_line &a, const shared_line &b);
+
+    public:
+        // lines are line numbers of lines of line_len bytes; find_site may
+        // be NULL, and is called when a line starts being tracked
+        SharingDetector(UINT32 nshards, UINT64 pline_len = 64,
+            UINT32 (*pfind_site)(ADDRINT addr) = NULL);
+
+        // the bytes accessed in a line, as the chunks passed to the rest
+        UINT64 chunks_of(UINT64 offset, UINT64 len);
+
+        // Calls on a shard are made by one thread at a time.
+        // core wrote the chunks written in line, and hands them to another
+        // core; lost are the cores that lost it to invalidations since they
+        // last had it
+        VOID handoff(UINT32 shard_id, ADDRINT line, UINT32 core,
+            UINT64 written, UINT64 lost);
+        // same, but core writes them back to the shared level instead,
+        // which only matters for the lines already tracked
+        VOID write_back(UINT32 shard_id, ADDRINT line, UINT32 core,
+            UINT64 written, UINT64 lost);
+        // a write of the instruction at ip took line away from other cores
+        VOID invalidation(UINT32 shard_id, ADDRINT line, ADDRINT ip);
+        // core missed on line, which it had lost to an invalidation, when
+        // the instruction at ip accessed chunks of it
+        VOID coherence_miss(UINT32 shard_id, ADDRINT line, UINT32 core,
+            UINT64 chunks, ADDRINT ip);
+
+        // reports the n lines with the most coherence misses, with names for
+        // their instructions, allocation sites and the cores that wrote
+        // them; once every thread is done
+        VOID output(std::ostream *outstream, UINT32 n,
+            string (*describe_ip)(ADDRINT ip),
+            string (*describe_site)(UINT32 site),
+            string (*describe_core)(UINT32 core));
+};
+
+
+//SharingDetector methods
+SharingDetector::shard::shard() : lines(64) {}
+
+SharingDetector::SharingDetector(UINT32 nshards, UINT64 pline_len,
+    UINT32 (*pfind_site)(ADDRINT addr)) :
+    line_len(pline_len), shards(nshards), find_site(pfind_site) {
+    offset_len = log2((int)line_len);
+    chunk_len = line_len > 64 ? line_len/64 : 1;
+}
+
+UINT64 SharingDetector::chunks_of(UINT64 offset, UINT64 len) {
+    UINT64 first = offset/chunk_len, last = (offset + len - 1)/chunk_len;
+    return (last - first == 63) ? ~0ULL :
+        ((1ULL << (last - first + 1)) - 1) << first;
+}
+
+SharingDetector::line_record *SharingDetector::find(UINT32 shard_id,
+    ADDRINT line) {
+    line_record **record = shards[shard_id].lines.find(line);
+    return record ? *record : NULL;
+}
+
+SharingDetector::line_record *SharingDetector::track(UINT32 shard_id,
+    ADDRINT line) {
+    line_record **record = shards[shard_id].lines.get(line);
+    if (!*record) {
+        *record = new line_record();
+        (*record)->site = find_site ? find_site(line << offset_len) :
+            ARQSIMUSHARING_NO_SITE;
+    }
+    return *record;
+}
+
+SharingDetector::core_bytes *SharingDetector::find_core(
+    line_record *record, UINT32 core) {
+    for (UINT32 i = 0; i < record->cores.size(); i++) {
+        if (record->cores[i].core == core)
+            return &record->cores[i];
+    }
+    return NULL;
+}
+
+SharingDetector::core_bytes *SharingDetector::add_core(line_record *record,
+    UINT32 core) {
+    UINT32 i = 0;
+    while (i < record->cores.size() && record->cores[i].core < core)
+        i++;
+    if (i < record->cores.size() && record->cores[i].core == core)
+        return &record->cores[i];
+
+    core_bytes bytes = {core, 0, 0};
+    record->cores.insert(record->cores.begin() + i, bytes);
+    return &record->cores[i];
+}
+
+VOID SharingDetector::add_written(line_record *record, UINT32 core,
+    UINT64 written, UINT64 lost) {
+    add_core(record, core)->written |= written;
+    lost &= ~(1ULL << core);
+    for (; lost; lost &= lost - 1)
+        add_core(record, __builtin_ctzll(lost))->unseen |= written;
+}
+
+VOID SharingDetector::handoff(UINT32 shard_id, ADDRINT line, UINT32 core,
+    UINT64 written, UINT64 lost) {
+    if (written)
+        add_written(track(shard_id, line), core, written, lost);
+}
+
+VOID SharingDetector::write_back(UINT32 shard_id, ADDRINT line,
+    UINT32 core, UINT64 written, UINT64 lost) {
+    // the cores that lost the line lost it to an invalidation, which
+    // tracks it
+    line_record *record = find(shard_id, line);
+    if (record && written)
+        add_written(record, core, written, lost);
+}
+
+VOID SharingDetector::invalidation(UINT32 shard_id, ADDRINT line,
+    ADDRINT ip) {
+    line_record *record = track(shard_id, line);
+    record->invalidations++;
+    count_ip(record, ip);
+}
+
+VOID SharingDetector::coherence_miss(UINT32 shard_id, ADDRINT line,
+    UINT32 core, UINT64 chunks, ADDRINT ip) {
+    line_record *record = find(shard_id, line);
+    if (!record)
+        return;
+
+    core_bytes *bytes = find_core(record, core);
+    if (bytes && (bytes->unseen & chunks))
+        record->true_sharing++;
+    else
+        record->false_sharing++;
+    if (bytes)
+        bytes->unseen = 0;
+    count_ip(record, ip);
+}
+
+VOID SharingDetector::count_ip(line_record *record, ADDRINT ip) {
+    if (!ip)
+        return;
+
+    // once every slot is taken, a new instruction takes the place of the
+    // one counted the least, and its count, so the ones involved the most
+    // stay
+    UINT32 least = 0;
+    for (UINT32 i = 0; i < ARQSIMUSHARING_IPS; i++) {
+        if (record->ips[i].ip == ip || !record->ips[i].count) {
+            record->ips[i].ip = ip;
+            record->ips[i].count++;
+            return;
+        }
+        if (record->ips[i].count < record->ips[least].count)
+            least = i;
+    }
+    record->ips[least].ip = ip;
+    record->ips[least].count++;
+}
+
+string SharingDetector::byte_ranges(UINT64 chunks) {
+    string ranges;
+    for (UINT64 first = 0; first < 64; first++) {
+        if (!(chunks & (1ULL << first)))
+            continue;
+        UINT64 last = first;
+        while (last < 63 && (chunks & (1ULL << (last + 1))))
+            last++;
+
+        if (!ranges.empty())
+            ranges += ", ";
+        ranges += uint_to_string(first*chunk_len) + "-" +
+            uint_to_string((last + 1)*chunk_len - 1);
+        first = last;
+    }
+    return ranges;
+}
+
+bool SharingDetector::more_misses(const shared_line &a,
+    const shared_line &b) {
+    return a.misses > b.misses;
+}
+
+VOID SharingDetector::output(std::ostream *outstream, UINT32 n,
+    string (*describe_ip)(ADDRINT ip),
+    string (*describe_site)(UINT32 site),
+    string (*describe_core)(UINT32 core)) {
+    // only the lines with coherence misses are listed
+    vector<shared_line> lines;
+    UINT64 tracked = 0, true_sharing = 0, false_sharing = 0;
+    for (UINT32 i = 0; i < shards.size(); i++) {
+        AddrMap<line_record *> *shard_lines = &shards[i].lines;
+        for (UINT64 j = 0; j < shard_lines->slots(); j++) {
+            if (shard_lines->key_at(j) == ARQSIMUHASH_EMPTY)
+                continue;
+            line_record *record = *shard_lines->value_at(j);
+            tracked++;
+            true_sharing += record->true_sharing;
+            false_sharing += record->false_sharing;
+            if (!record->true_sharing && !record->false_sharing)
+                continue;
+
+            shared_line line = {record->true_sharing + record->false_sharing,
+                shard_lines->key_at(j), record};
+            lines.push_back(line);
+        }
+    }
+
+    UINT64 misses = true_sharing + false_sharing;
+    *outstream << "=====" << std::endl;
+    *outstream << "sharing:" << std::endl;
+    *outstream << "\ttrue sharing/coherence misses: " <<
+        uint_to_string(true_sharing) << " / " << uint_to_string(misses) <<
+        " = " << double_to_string(true_sharing/(double)misses) << std::endl;
+    *outstream << "\tfalse sharing/coherence misses: " <<
+        uint_to_string(false_sharing) << " / " << uint_to_string(misses) <<
+        " = " << double_to_string(false_sharing/(double)misses) << std::endl;
+    *outstream << "\tlines taken from another core: " <<
+        uint_to_string(tracked) << std::endl;
+
+    if (n > lines.size())
+        n = lines.size();
+    std::partial_sort(lines.begin(), lines.begin() + n, lines.end(),
+        more_misses);
+
+    *outstream << "=====" << std::endl;
+    *outstream << "lines with the most coherence misses (top " <<
+        uint_to_string(n) << "):" << std::endl;
+    for (UINT32 i = 0; i < n; i++) {
+        line_record *record = lines[i].record;
+        *outstream << "\t" << hex_to_string(lines[i].line << offset_len);
+        if (record->site != ARQSIMUSHARING_NO_SITE)
+            *outstream << " (" << describe_site(record->site) << ")";
+        *outstream << ": " << uint_to_string(record->true_sharing) <<
+            " true sharing, " << uint_to_string(record->false_sharing) <<
+            " false sharing misses, " <<
+            uint_to_string(record->invalidations) << " invalidations" <<
+            std::endl;
+
+        for (UINT32 j = 0; j < record->cores.size(); j++) {
+            if (record->cores[j].written)
+                *outstream << "\t\twritten by " <<
+                    describe_core(record->cores[j].core) << ": bytes " <<
+                    byte_ranges(record->cores[j].written) << std::endl;
+        }
+        for (UINT32 j = 0; j < ARQSIMUSHARING_IPS; j++) {
+            if (record->ips[j].count)
+                *outstream << "\t\t" << hex_to_string(record->ips[j].ip) <<
+                    " " << describe_ip(record->ips[j].ip) << ": " <<
+                    uint_to_string(record->ips[j].count) << std::endl;
+        }
+    }
+}
+
+#endif
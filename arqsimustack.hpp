@@ -0,0 +1,254 @@
+#ifndef __ARQSIMUSTACK_HPP__
+#define __ARQSIMUSTACK_HPP__
+
+#include "arqsimuhash.h"
+
+// Order statistics tree (a treap) of access times. Each set of each
+// simulated set count keeps the last access time of its lines in one, so
+// that the LRU stack distance of a line is the number of times in its set
+// later than the line's own, which takes O(log n) to count.
+//
+// The trees of all the sets share a node pool, and node 0 is the empty tree.
+class TimeTree {
+    private:
+        struct node {
+            UINT64 time;
+            UINT32 priority;
+            UINT32 size;
+            UINT32 left, right;
+        };
+
+        vector<node> nodes;
+        vector<UINT32> free_nodes;
+        UINT32 seed;
+
+        UINT32 new_node(UINT64 time);
+        VOID update(UINT32 n);
+        // splits a tree into the times lower than time and the rest
+        VOID split(UINT32 n, UINT64 time, UINT32 *lower, UINT32 *rest);
+        UINT32 merge(UINT32 lower, UINT32 higher);
+
+    public:
+        TimeTree();
+
+        bool contains(UINT32 root, UINT64 time);
+        UINT32 count_later(UINT32 root, UINT64 time);
+        UINT32 size(UINT32 root);
+        // these return the new root of the tree
+        UINT32 insert(UINT32 root, UINT64 time);
+        UINT32 erase(UINT32 root, UINT64 time);
+        UINT32 erase_oldest(UINT32 root);
+};
+
+// LRU stack distance profile of a reference stream (Mattson et al.): in a
+// single pass it gives the hit ratio of every LRU cache with
+// min_sets..max_sets sets (powers of 2) and 1..max_ways ways.
+//
+// For each set count, a set only remembers its max_ways most recently used
+// lines, since deeper lines miss in every cache of the grid anyway.
+class StackDistance {
+    private:
+        UINT64 offset_len, min_sets, max_sets, max_ways;
+        UINT64 time;
+        // last access time of every line seen
+        AddrMap<UINT64> last_access;
+        TimeTree tree;
+        // per set count, from min_sets up: one tree per set, and how many
+        // accesses had each stack distance (max_ways means it was deeper,
+        // or the first access to the line)
+        vector< vector<UINT32> > roots;
+        vector< vector<UINT64> > distances;
+
+    public:
+        StackDistance(UINT64 line_len = 16, UINT64 pmin_sets = 1,
+            UINT64 pmax_sets = 4096, UINT64 pmax_ways = 16);
+
+        VOID access(ADDRINT addr);
+        // accounts for accesses repeating the last one, which are at
+        // distance 0 in every cache
+        VOID count_repeats(UINT64 n);
+        VOID output(std::ostream *outstream);
+};
+
+
+//TimeTree methods
+TimeTree::TimeTree() : nodes(1), seed(2463534242U) {
+    nodes[0].size = 0;
+    nodes[0].left = nodes[0].right = 0;
+}
+
+UINT32 TimeTree::new_node(UINT64 time) {
+    UINT32 n;
+    if (!free_nodes.empty()) {
+        n = free_nodes.back();
+        free_nodes.pop_back();
+    } else {
+        n = nodes.size();
+        nodes.push_back(node());
+    }
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    nodes[n].time = time;
+    nodes[n].priority = seed;
+    nodes[n].size = 1;
+    nodes[n].left = nodes[n].right = 0;
+    return n;
+}
+
+VOID TimeTree::update(UINT32 n) {
+    nodes[n].size = 1 + nodes[nodes[n].left].size +
+        nodes[nodes[n].right].size;
+}
+
+VOID TimeTree::split(UINT32 n, UINT64 time, UINT32 *lower, UINT32 *rest) {
+    if (!n) {
+        *lower = *rest = 0;
+    } else if (nodes[n].time < time) {
+        split(nodes[n].right, time, &nodes[n].right, rest);
+        update(n);
+        *lower = n;
+    } else {
+        split(nodes[n].left, time, lower, &nodes[n].left);
+        update(n);
+        *rest = n;
+    }
+}
+
+UINT32 TimeTree::merge(UINT32 lower, UINT32 higher) {
+    if (!lower)
+        return higher;
+    if (!higher)
+        return lower;
+
+    if (nodes[lower].priority > nodes[higher].priority) {
+        nodes[lower].right = merge(nodes[lower].right, higher);
+        update(lower);
+        return lower;
+    }
+    nodes[higher].left = merge(lower, nodes[higher].left);
+    update(higher);
+    return higher;
+}
+
+bool TimeTree::contains(UINT32 root, UINT64 time) {
+    UINT32 n = root;
+    while (n && nodes[n].time != time)
+        n = (time < nodes[n].time) ? nodes[n].left : nodes[n].right;
+    return n != 0;
+}
+
+UINT32 TimeTree::count_later(UINT32 root, UINT64 time) {
+    UINT32 count = 0;
+    for (UINT32 n = root; n; ) {
+        if (nodes[n].time > time) {
+            count += 1 + nodes[nodes[n].right].size;
+            n = nodes[n].left;
+        } else {
+            n = nodes[n].right;
+        }
+    }
+    return count;
+}
+
+UINT32 TimeTree::size(UINT32 root) {
+    return nodes[root].size;
+}
+
+UINT32 TimeTree::insert(UINT32 root, UINT64 time) {
+    UINT32 lower, rest;
+    split(root, time, &lower, &rest);
+    return merge(merge(lower, new_node(time)), rest);
+}
+
+UINT32 TimeTree::erase(UINT32 root, UINT64 time) {
+    UINT32 lower, rest, match, higher;
+    split(root, time, &lower, &rest);
+    split(rest, time + 1, &match, &higher);
+    if (match)
+        free_nodes.push_back(match);
+    return merge(lower, higher);
+}
+
+UINT32 TimeTree::erase_oldest(UINT32 root) {
+    UINT32 n = root;
+    while (nodes[n].left)
+        n = nodes[n].left;
+    return erase(root, nodes[n].time);
+}
+
+
+//StackDistance methods
+StackDistance::StackDistance(UINT64 line_len, UINT64 pmin_sets,
+    UINT64 pmax_sets, UINT64 pmax_ways) : min_sets(pmin_sets),
+    max_sets(pmax_sets), max_ways(pmax_ways), time(0), last_access(1 << 16) {
+    offset_len = log2((int)line_len);
+
+    for (UINT64 sets = min_sets; sets <= max_sets; sets <<= 1) {
+        roots.push_back(vector<UINT32>(sets, 0));
+        distances.push_back(vector<UINT64>(max_ways + 1, 0));
+    }
+}
+
+VOID StackDistance::access(ADDRINT addr) {
+    UINT64 line = addr >> offset_len;
+    UINT64 *last = last_access.get(line);
+    bool seen = (*last != 0);
+    UINT64 last_time = *last;
+    *last = ++time;
+
+    UINT64 sets = min_sets;
+    for (UINT64 i = 0; i < roots.size(); i++, sets <<= 1) {
+        UINT32 *root = &roots[i][line & (sets - 1)];
+
+        UINT64 distance = max_ways;
+        if (seen && tree.contains(*root, last_time)) {
+            distance = tree.count_later(*root, last_time);
+            *root = tree.erase(*root, last_time);
+        } else if (tree.size(*root) == max_ways) {
+            *root = tree.erase_oldest(*root);
+        }
+
+        *root = tree.insert(*root, time);
+        distances[i][distance]++;
+    }
+}
+
+VOID StackDistance::count_repeats(UINT64 n) {
+    for (UINT64 i = 0; i < distances.size(); i++)
+        distances[i][0] += n;
+}
+
+VOID StackDistance::output(std::ostream *outstream) {
+    *outstream << "=====" << std::endl;
+    *outstream << "LRU miss ratios (" << uint_to_string(1 << offset_len) <<
+        " byte lines, size = sets*ways*line length):" << std::endl;
+
+    *outstream << "\tsets\\ways";
+    for (UINT64 ways = 1; ways <= max_ways; ways <<= 1)
+        *outstream << "\t" << uint_to_string(ways);
+    *outstream << std::endl;
+
+    UINT64 sets = min_sets;
+    for (UINT64 i = 0; i < distances.size(); i++, sets <<= 1) {
+        UINT64 accesses = 0;
+        for (UINT64 d = 0; d <= max_ways; d++)
+            accesses += distances[i][d];
+
+        *outstream << "\t" << uint_to_string(sets);
+
+        // a cache with n ways hits every access at distance < n
+        UINT64 hits = 0, d = 0;
+        for (UINT64 ways = 1; ways <= max_ways; ways <<= 1) {
+            for (; d < ways; d++)
+                hits += distances[i][d];
+            *outstream << "\t" <<
+                double_to_string(1 - hits/(double)accesses);
+        }
+        *outstream << std::endl;
+    }
+}
+
+#endif
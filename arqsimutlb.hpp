@@ -0,0 +1,222 @@
+#ifndef __ARQSIMUTLB_HPP__
+#define __ARQSIMUTLB_HPP__
+
+#include "arqsimucache.hpp"
+
+// overhead in cycles of a hit in each TLB level; a hit in the first one
+// overlaps the L1 lookup
+#define ARQSIMUTLB_L1OH 0
+#define ARQSIMUTLB_L2OH 2
+
+// x86-64 page tables: four levels of 512 entries of 8 bytes, indexed by 9
+// bits each above the 12 bit offset of 4k pages; 2m and 1g pages end the
+// walk one and two levels earlier
+#define ARQSIMUTLB_LEVELS 4
+#define ARQSIMUTLB_LEVEL_BITS 9
+#define ARQSIMUTLB_PAGE_BITS 12
+#define ARQSIMUTLB_ENTRY_LEN 8
+
+// page tables are placed at made up addresses in the kernel half of the
+// address space, where the program's own accesses never go, each level in
+// a region of its own with its tables back to back
+#define ARQSIMUTLB_TABLES 0xffff800000000000ULL
+#define ARQSIMUTLB_LEVEL_SPAN (1ULL << 40)
+
+// One TLB level: a set associative, LRU array of page numbers
+class TLB {
+    private:
+        string description;
+        TagStore pages;
+        ReplacementPolicy *policy;
+        UINT64 entries, ways, index_bits, index_mask;
+        UINT64 lookups, hits;
+
+    public:
+        TLB(string pdescription, UINT64 pentries = 64, UINT64 pways = 4);
+
+        // whether page is in the TLB, updating the LRU order if it is
+        bool lookup(UINT64 page);
+        VOID fill(UINT64 page);
+        // accounts for hits that the tool resolved without looking up
+        VOID count_hits(UINT64 new_hits);
+        VOID output(std::ostream *outstream, string page_size);
+};
+
+// The data TLBs in front of a cache hierarchy: a first level TLB, a second
+// level one behind it, and a page walker that, on a miss in both, reads
+// the page table entries of the address through the hierarchy like any
+// other data, so walks take up cache lines and cost what the caches say.
+// All pages have the same size.
+class DataTLBs {
+    private:
+        TLB first, second;
+        Memory *memory;
+        string page_size;
+        UINT64 page_bits, walk_levels;
+        UINT64 walks, walk_reads[ARQSIMUTLB_LEVELS];
+        UINT64 walk_cycles[ARQSIMUTLB_LEVELS];
+
+        UINT64 walk(UINT64 page, VOID *ip);
+
+    public:
+        // page_size is 4k, 2m or 1g
+        DataTLBs(Memory *pmemory, string ppage_size = "4k",
+            UINT64 first_entries = 64, UINT64 first_ways = 4,
+            UINT64 second_entries = 1536, UINT64 second_ways = 12);
+
+        // translates the pages of size bytes from addr, and returns the
+        // overhead in cycles
+        UINT64 translate(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        VOID count_hits(UINT64 hits);
+        VOID output(std::ostream *outstream);
+};
+
+bool is_page_size(string name);
+// whether a TLB can have entries in sets of ways: the page number picks a
+// set with whole bits, so there have to be a power of 2 of them
+bool is_tlb_geometry(UINT64 entries, UINT64 ways);
+
+
+//TLB methods
+TLB::TLB(string pdescription, UINT64 pentries, UINT64 pways) :
+    description(pdescription), pages(pentries/pways, pways),
+    entries(pentries), ways(pways), lookups(0), hits(0) {
+    index_bits = log2((int)(entries/ways));
+    index_mask = (1ULL << index_bits) - 1;
+    policy = make_replacement_policy("lru", entries/ways, ways);
+}
+
+bool TLB::lookup(UINT64 page) {
+    lookups++;
+    UINT64 index = page & index_mask;
+    INT32 way = pages.find(index, page >> index_bits);
+    if (way < 0)
+        return false;
+
+    hits++;
+    policy->touch(index, way);
+    return true;
+}
+
+VOID TLB::fill(UINT64 page) {
+    UINT64 index = page & index_mask;
+    INT32 way = pages.find_free(index);
+    if (way < 0)
+        way = policy->victim(index);
+    pages.fill(index, way, page >> index_bits);
+    policy->insert(index, way);
+}
+
+VOID TLB::count_hits(UINT64 new_hits) {
+    lookups += new_hits;
+    hits += new_hits;
+}
+
+VOID TLB::output(std::ostream *outstream, string page_size) {
+    *outstream << "=====" << std::endl;
+    *outstream << description << ":" << std::endl;
+    *outstream << "\thits/lookups: " << uint_to_string(hits) << " / " <<
+        uint_to_string(lookups) << " = " <<
+        double_to_string(hits/(double)lookups) << std::endl;
+    *outstream << "\tentries: " << uint_to_string(entries) << ", " <<
+        uint_to_string(ways) << " ways, " << page_size << " pages" <<
+        std::endl;
+}
+
+
+//DataTLBs methods
+DataTLBs::DataTLBs(Memory *pmemory, string ppage_size,
+    UINT64 first_entries, UINT64 first_ways, UINT64 second_entries,
+    UINT64 second_ways) :
+    first("L1 dTLB", first_entries, first_ways),
+    second("L2 TLB", second_entries, second_ways), memory(pmemory),
+    page_size(ppage_size), walks(0) {
+    // every larger page size takes one more level of the address
+    UINT64 larger = (page_size == "2m") ? 1 : (page_size == "1g") ? 2 : 0;
+    page_bits = ARQSIMUTLB_PAGE_BITS + larger*ARQSIMUTLB_LEVEL_BITS;
+    walk_levels = ARQSIMUTLB_LEVELS - larger;
+
+    for (UINT32 level = 0; level < ARQSIMUTLB_LEVELS; level++)
+        walk_reads[level] = walk_cycles[level] = 0;
+}
+
+UINT64 DataTLBs::walk(UINT64 page, VOID *ip) {
+    walks++;
+    ADDRINT addr = page << page_bits;
+
+    UINT64 total_overhead = 0;
+    for (UINT32 level = 0; level < walk_levels; level++) {
+        // the entry for addr in the level's tables: tables are indexed by
+        // everything above, so the one for addr starts where the entries
+        // of the previous tables end
+        UINT64 shift = ARQSIMUTLB_PAGE_BITS +
+            (ARQSIMUTLB_LEVELS - 1 - level)*ARQSIMUTLB_LEVEL_BITS;
+        ADDRINT entry = ARQSIMUTLB_TABLES + level*ARQSIMUTLB_LEVEL_SPAN +
+            ((addr & ((1ULL << 48) - 1)) >> shift)*ARQSIMUTLB_ENTRY_LEN;
+
+        UINT64 overhead = memory->read((VOID *)entry, ip,
+            ARQSIMUTLB_ENTRY_LEN);
+        walk_reads[level]++;
+        walk_cycles[level] += overhead;
+        total_overhead += overhead;
+    }
+    return total_overhead;
+}
+
+UINT64 DataTLBs::translate(VOID *addr, VOID *ip, UINT32 size) {
+    UINT64 total_overhead = 0;
+    UINT64 page = (ADDRINT)addr >> page_bits;
+    UINT64 last = ((ADDRINT)addr + (size ? size : 1) - 1) >> page_bits;
+    for (; page <= last; page++) {
+        total_overhead += ARQSIMUTLB_L1OH;
+        if (first.lookup(page))
+            continue;
+
+        total_overhead += ARQSIMUTLB_L2OH;
+        if (!second.lookup(page)) {
+            total_overhead += walk(page, ip);
+            second.fill(page);
+        }
+        first.fill(page);
+    }
+    return total_overhead;
+}
+
+VOID DataTLBs::count_hits(UINT64 hits) {
+    first.count_hits(hits);
+}
+
+VOID DataTLBs::output(std::ostream *outstream) {
+    first.output(outstream, page_size);
+    second.output(outstream, page_size);
+
+    UINT64 total_cycles = 0;
+    for (UINT32 level = 0; level < walk_levels; level++)
+        total_cycles += walk_cycles[level];
+
+    *outstream << "=====" << std::endl;
+    *outstream << "page walks:" << std::endl;
+    *outstream << "\twalk cycles/walks: " << uint_to_string(total_cycles) <<
+        " / " << uint_to_string(walks) << " = " <<
+        double_to_string(total_cycles/(double)walks) << std::endl;
+    for (UINT32 level = 0; level < walk_levels; level++) {
+        *outstream << "\tlevel " << uint_to_string(level + 1) <<
+            " cycles/reads: " << uint_to_string(walk_cycles[level]) <<
+            " / " << uint_to_string(walk_reads[level]) << " = " <<
+            double_to_string(walk_cycles[level]/(double)walk_reads[level]) <<
+            std::endl;
+    }
+}
+
+bool is_page_size(string name) {
+    return name == "4k" || name == "2m" || name == "1g";
+}
+
+bool is_tlb_geometry(UINT64 entries, UINT64 ways) {
+    if (!ways || entries % ways)
+        return false;
+    UINT64 sets = entries/ways;
+    return sets == (1ULL << log2((int)sets));
+}
+
+#endif
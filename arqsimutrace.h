@@ -0,0 +1,296 @@
+#ifndef __ARQSIMUTRACE_H__
+#define __ARQSIMUTRACE_H__
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "arqsimucommons.h"
+
+// Binary trace of memory references and conditional branches, as written by
+// arqsimurecord and read by arqsimureplay.
+//
+// The file starts with ARQSIMUTRACE_MAGIC followed by the records. Each
+// record is a header byte, followed by variable length fields:
+//
+//   header bits 0-1: kind (ARQSIMUTRACE_READ, _WRITE or _BRANCH)
+//   header bit 2:    the ip is the same as in the previous record (further
+//                    memory operands of the same instruction), so it's
+//                    omitted
+//   header bits 3-7: for memory references, the access size, or
+//                    ARQSIMUTRACE_BIGSIZE if it's stored as a varint after
+//                    the address; for branches, bit 3 is the outcome
+//   ip:              difference with the previous ip (zigzag varint)
+//   address:         for memory references, difference with the previous
+//                    address; for branches, target minus ip (zigzag varint)
+//
+// Consecutive instructions and addresses are usually close to each other, so
+// most records take 2 to 4 bytes.
+
+#define ARQSIMUTRACE_MAGIC "ARQTRC01"
+#define ARQSIMUTRACE_MAGIC_LEN 8
+
+#define ARQSIMUTRACE_READ 0
+#define ARQSIMUTRACE_WRITE 1
+#define ARQSIMUTRACE_BRANCH 2
+
+#define ARQSIMUTRACE_KIND_MASK 0x3
+#define ARQSIMUTRACE_SAME_IP 0x4
+#define ARQSIMUTRACE_TAKEN 0x8
+#define ARQSIMUTRACE_SIZE_SHIFT 3
+#define ARQSIMUTRACE_BIGSIZE 31
+
+// a decoded record; for branches, addr is the target and size is 1 if the
+// branch was taken
+struct trace_record {
+    UINT32 kind;
+    UINT32 size;
+    ADDRINT ip;
+    ADDRINT addr;
+};
+
+class TraceWriter {
+    private:
+        FILE *file;
+        vector<UINT8> buffer;
+        UINT64 used;
+        ADDRINT last_ip, last_addr;
+        UINT64 records;
+        // some write to the file failed, so the trace is incomplete
+        bool failed;
+
+        VOID put_varint(UINT64 value);
+        VOID put_delta(ADDRINT value, ADDRINT previous);
+        VOID flush();
+
+    public:
+        TraceWriter();
+
+        bool open(string path);
+        VOID write(const trace_record &record);
+        // returns false if the trace couldn't be written whole
+        bool close();
+        UINT64 get_records();
+};
+
+// Reads a trace by mapping the whole file and decoding it sequentially
+class TraceReader {
+    private:
+        const UINT8 *data, *pos, *end;
+        size_t len;
+        ADDRINT last_ip, last_addr;
+        bool corrupt;
+
+        // both return false if the field is cut off or too long
+        bool get_varint(UINT64 *value);
+        bool get_delta(ADDRINT previous, ADDRINT *value);
+
+    public:
+        TraceReader();
+
+        bool open(string path);
+        // decodes the next record, returns false at the end of the trace
+        // or if the record is cut off or corrupt
+        bool next(trace_record *record);
+        // whether next() stopped on a record it couldn't decode
+        bool is_corrupt();
+        VOID close();
+};
+
+
+//TraceWriter methods
+TraceWriter::TraceWriter() : file(NULL), buffer(1 << 20), used(0),
+    last_ip(0), last_addr(0), records(0), failed(false) {}
+
+bool TraceWriter::open(string path) {
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    if (fwrite(ARQSIMUTRACE_MAGIC, 1, ARQSIMUTRACE_MAGIC_LEN, file) !=
+        ARQSIMUTRACE_MAGIC_LEN) {
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+    return true;
+}
+
+VOID TraceWriter::put_varint(UINT64 value) {
+    while (value >= 0x80) {
+        buffer[used++] = (UINT8)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[used++] = (UINT8)value;
+}
+
+VOID TraceWriter::put_delta(ADDRINT value, ADDRINT previous) {
+    INT64 delta = (INT64)(value - previous);
+    // zigzag, so that small negative deltas are small too
+    put_varint(((UINT64)delta << 1) ^ (UINT64)(delta >> 63));
+}
+
+VOID TraceWriter::flush() {
+    if (used && fwrite(&buffer[0], 1, used, file) != used)
+        failed = true;
+    used = 0;
+}
+
+VOID TraceWriter::write(const trace_record &record) {
+    // a record never takes more than 1 + 3*10 bytes
+    if (used + 32 > buffer.size())
+        flush();
+
+    UINT8 header = record.kind;
+    bool same_ip = (record.ip == last_ip);
+    if (same_ip)
+        header |= ARQSIMUTRACE_SAME_IP;
+
+    bool big_size = false;
+    if (record.kind == ARQSIMUTRACE_BRANCH) {
+        if (record.size)
+            header |= ARQSIMUTRACE_TAKEN;
+    } else if (record.size < ARQSIMUTRACE_BIGSIZE) {
+        header |= record.size << ARQSIMUTRACE_SIZE_SHIFT;
+    } else {
+        header |= ARQSIMUTRACE_BIGSIZE << ARQSIMUTRACE_SIZE_SHIFT;
+        big_size = true;
+    }
+
+    buffer[used++] = header;
+    if (!same_ip)
+        put_delta(record.ip, last_ip);
+    last_ip = record.ip;
+
+    if (record.kind == ARQSIMUTRACE_BRANCH) {
+        put_delta(record.addr, record.ip);
+    } else {
+        put_delta(record.addr, last_addr);
+        last_addr = record.addr;
+        if (big_size)
+            put_varint(record.size);
+    }
+
+    records++;
+}
+
+bool TraceWriter::close() {
+    if (!file)
+        return !failed;
+
+    flush();
+    if (fclose(file))
+        failed = true;
+    file = NULL;
+    return !failed;
+}
+
+UINT64 TraceWriter::get_records() {
+    return records;
+}
+
+
+//TraceReader methods
+TraceReader::TraceReader() : data(NULL), pos(NULL), end(NULL), len(0),
+    last_ip(0), last_addr(0), corrupt(false) {}
+
+bool TraceReader::open(string path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < ARQSIMUTRACE_MAGIC_LEN) {
+        ::close(fd);
+        return false;
+    }
+
+    len = st.st_size;
+    VOID *mapped = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+
+    // pages are only touched once, in order
+    madvise(mapped, len, MADV_SEQUENTIAL);
+
+    data = (const UINT8 *)mapped;
+    if (memcmp(data, ARQSIMUTRACE_MAGIC, ARQSIMUTRACE_MAGIC_LEN)) {
+        close();
+        return false;
+    }
+
+    pos = data + ARQSIMUTRACE_MAGIC_LEN;
+    end = data + len;
+    return true;
+}
+
+bool TraceReader::get_varint(UINT64 *value) {
+    // 64 bits take at most 10 bytes, the last one with shift 63
+    *value = 0;
+    for (UINT32 shift = 0; shift <= 63 && pos < end; shift += 7) {
+        UINT8 byte = *pos++;
+        *value |= (UINT64)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool TraceReader::get_delta(ADDRINT previous, ADDRINT *value) {
+    UINT64 zigzag;
+    if (!get_varint(&zigzag))
+        return false;
+    INT64 delta = (INT64)(zigzag >> 1) ^ -(INT64)(zigzag & 1);
+    *value = previous + delta;
+    return true;
+}
+
+bool TraceReader::next(trace_record *record) {
+    if (pos >= end || corrupt)
+        return false;
+
+    UINT8 header = *pos++;
+    record->kind = header & ARQSIMUTRACE_KIND_MASK;
+    if (record->kind > ARQSIMUTRACE_BRANCH) {
+        corrupt = true;
+        return false;
+    }
+
+    if (!(header & ARQSIMUTRACE_SAME_IP) && !get_delta(last_ip, &last_ip)) {
+        corrupt = true;
+        return false;
+    }
+    record->ip = last_ip;
+
+    bool complete;
+    if (record->kind == ARQSIMUTRACE_BRANCH) {
+        record->size = (header & ARQSIMUTRACE_TAKEN) ? 1 : 0;
+        complete = get_delta(record->ip, &record->addr);
+    } else {
+        record->size = header >> ARQSIMUTRACE_SIZE_SHIFT;
+        complete = get_delta(last_addr, &last_addr);
+        record->addr = last_addr;
+        if (complete && record->size == ARQSIMUTRACE_BIGSIZE) {
+            UINT64 size;
+            complete = get_varint(&size);
+            record->size = size;
+        }
+    }
+
+    corrupt = !complete;
+    return complete;
+}
+
+bool TraceReader::is_corrupt() {
+    return corrupt;
+}
+
+VOID TraceReader::close() {
+    if (data)
+        munmap((VOID *)data, len);
+    data = pos = end = NULL;
+}
+
+#endif
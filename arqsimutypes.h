@@ -0,0 +1,39 @@
+#ifndef __ARQSIMUTYPES_H__
+#define __ARQSIMUTYPES_H__
+
+// The simulators only need Pin's basic types. Programs that run outside of
+// Pin (like arqsimureplay) define ARQSIMU_NO_PIN and get them from here.
+#ifndef ARQSIMU_NO_PIN
+#include "pin.H"
+
+// gives up the processor while spinning on another thread
+#define ARQSIMU_YIELD() PIN_Yield()
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int8_t INT8;
+typedef int16_t INT16;
+typedef int32_t INT32;
+typedef int64_t INT64;
+typedef void VOID;
+typedef bool BOOL;
+typedef char CHAR;
+typedef uintptr_t ADDRINT;
+typedef UINT32 THREADID;
+
+#include <sched.h>
+#define ARQSIMU_YIELD() sched_yield()
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef __ARQSIMUVICTIM_HPP__
+#define __ARQSIMUVICTIM_HPP__
+
+#include "arqsimucache.hpp"
+
+// overhead in cycles of a hit in a victim or miss cache
+#define ARQSIMUVICTIM_OH 1
+
+// Small fully associative cache between a level and the next one (Jouppi,
+// 1990). As a victim cache it takes the lines the level above evicts, and
+// gives a line back (dropping it) when the level above misses on it, so
+// lines that conflict in a set above can both stay close. As a miss cache
+// it keeps a copy of every line the level above misses on instead.
+// Whatever it can't serve goes on to next. Entries are replaced LRU.
+class VictimCache : public Memory {
+    private:
+        struct entry {
+            ADDRINT line;
+            bool dirty;
+        };
+
+        string description;
+        Memory *next;
+        UINT64 capacity, line_len;
+        bool miss_cache;
+        // most recently used first
+        vector<entry> entries;
+        UINT64 reads, read_hits, writes, write_hits, fills, writebacks;
+
+        INT32 find(ADDRINT line);
+        VOID touch(UINT32 i);
+        // returns the overhead of writing back the entry it replaces
+        UINT64 insert(ADDRINT line, bool dirty);
+
+    public:
+        VictimCache(string pdescription, Memory *pnext, UINT64 pcapacity = 8,
+            UINT64 pline_len = 16, bool pmiss_cache = false);
+
+        virtual UINT64 read(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        virtual UINT64 write(VOID *addr, VOID *ip = NULL, UINT32 size = 1);
+        virtual UINT64 evicted(VOID *addr, UINT32 size, bool dirty);
+        virtual VOID advance_to(UINT64 now);
+        virtual bool takes_evicted();
+        virtual VOID output(std::ostream *outstream);
+};
+
+
+//VictimCache methods
+VictimCache::VictimCache(string pdescription, Memory *pnext,
+    UINT64 pcapacity, UINT64 pline_len, bool pmiss_cache) :
+    Memory(ARQSIMUVICTIM_OH), description(pdescription), next(pnext),
+    capacity(pcapacity), line_len(pline_len), miss_cache(pmiss_cache),
+    reads(0), read_hits(0), writes(0), write_hits(0), fills(0),
+    writebacks(0) {}
+
+INT32 VictimCache::find(ADDRINT line) {
+    for (UINT32 i = 0; i < entries.size(); i++) {
+        if (entries[i].line == line)
+            return i;
+    }
+    return -1;
+}
+
+VOID VictimCache::touch(UINT32 i) {
+    entry e = entries[i];
+    entries.erase(entries.begin() + i);
+    entries.insert(entries.begin(), e);
+}
+
+UINT64 VictimCache::insert(ADDRINT line, bool dirty) {
+    INT32 i = find(line);
+    if (i >= 0) {
+        entries[i].dirty |= dirty;
+        touch(i);
+        return 0;
+    }
+
+    UINT64 total_overhead = 0;
+    if (entries.size() == capacity) {
+        if (entries.back().dirty) {
+            writebacks++;
+            total_overhead += next->write((VOID *)entries.back().line, NULL,
+                line_len);
+        }
+        entries.pop_back();
+    }
+
+    entry e = {line, dirty};
+    entries.insert(entries.begin(), e);
+    return total_overhead;
+}
+
+UINT64 VictimCache::read(VOID *addr, VOID *ip, UINT32 size) {
+    reads++;
+    ADDRINT line = (ADDRINT)addr & ~(line_len - 1);
+    INT32 i = find(line);
+    UINT64 total_overhead = get_overhead();
+
+    if (i >= 0) {
+        read_hits++;
+        if (miss_cache) {
+            touch(i);
+            return total_overhead;
+        }
+
+        // the line moves up, and the level above gets it clean, so the
+        // data that only this cache had goes down
+        if (entries[i].dirty) {
+            writebacks++;
+            total_overhead += next->write((VOID *)line, NULL, line_len);
+        }
+        entries.erase(entries.begin() + i);
+        return total_overhead;
+    }
+
+    total_overhead += next->read(addr, ip, size);
+    if (miss_cache)
+        total_overhead += insert(line, false);
+    return total_overhead;
+}
+
+UINT64 VictimCache::write(VOID *addr, VOID *ip, UINT32 size) {
+    writes++;
+    ADDRINT line = (ADDRINT)addr & ~(line_len - 1);
+    INT32 i = find(line);
+    UINT64 total_overhead = get_overhead();
+
+    // miss caches only keep copies, so writes always go on
+    if (i >= 0) {
+        write_hits++;
+        if (!miss_cache) {
+            entries[i].dirty = true;
+            touch(i);
+            return total_overhead;
+        }
+    }
+
+    return total_overhead + next->write(addr, ip, size);
+}
+
+UINT64 VictimCache::evicted(VOID *addr, UINT32 size, bool dirty) {
+    if (miss_cache)
+        return dirty ? write(addr, NULL, size) : 0;
+
+    // the write back of a dirty victim counts as a write of the level
+    // above
+    ADDRINT line = (ADDRINT)addr & ~(line_len - 1);
+    UINT64 total_overhead = 0;
+    if (dirty) {
+        writes++;
+        total_overhead += get_overhead();
+        if (find(line) >= 0) {
+            write_hits++;
+            return total_overhead + insert(line, true);
+        }
+    }
+    fills++;
+    return total_overhead + insert(line, dirty);
+}
+
+VOID VictimCache::advance_to(UINT64 now) {
+    next->advance_to(now);
+}
+
+bool VictimCache::takes_evicted() {
+    return !miss_cache;
+}
+
+VOID VictimCache::output(std::ostream *outstream) {
+    output_cache_stats(outstream, description, reads, read_hits, writes,
+        write_hits, 0, "lru");
+    *outstream << "\tentries: " << uint_to_string(capacity) <<
+        (miss_cache ? " (miss cache)" : " (victim cache)") << std::endl;
+    *outstream << "\thit overhead: " << uint_to_string(get_overhead()) <<
+        " cycles" << std::endl;
+    if (!miss_cache)
+        *outstream << "\tvictims taken: " << uint_to_string(fills) <<
+            std::endl;
+    *outstream << "\twritebacks: " << uint_to_string(writebacks) <<
+        std::endl;
+    next->output(outstream);
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __ARQSIMUWAYMATCH_H__
+#define __ARQSIMUWAYMATCH_H__
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "arqsimutypes.h"
+
+// Compares tag against the tags of every way of a set and returns the way
+// that holds it, or -1 if none does. Tags are unique within a set, so the
+// first match is the only one.
+//
+// The widest kernel the tool is compiled for is used (AVX2 compares 4 ways
+// per instruction, SSE2 compares 2), and the remaining ways are compared
+// one by one.
+static inline INT32 find_way(const UINT64 *tags, UINT32 ways, UINT64 tag) {
+    UINT32 way = 0;
+
+#if defined(__AVX2__)
+    __m256i wanted4 = _mm256_set1_epi64x(tag);
+    for (; way + 4 <= ways; way += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(wanted4,
+            _mm256_loadu_si256((const __m256i *)(tags + way)));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (mask)
+            return way + __builtin_ctz(mask);
+    }
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    __m128i wanted2 = _mm_set1_epi64x(tag);
+    for (; way + 2 <= ways; way += 2) {
+        // SSE2 has no 64 bit compare: both 32 bit halves have to match
+        __m128i eq = _mm_cmpeq_epi32(wanted2,
+            _mm_loadu_si128((const __m128i *)(tags + way)));
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask)
+            return way + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; way < ways; way++) {
+        if (tags[way] == tag)
+            return way;
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#define L1_SIZE 65536
+#define N 100000
+
+/* Two lines that conflict in a direct mapped L1 of L1_SIZE bytes, read and
+ * then written in turns. Run with -l1_ways 1 -l1_victim_cache 1: after the
+ * first round every miss of both loops should hit in the victim cache. */
+static volatile char a[2*L1_SIZE];
+
+int main(int argc, char *argv[]) {
+    int i;
+    char b;
+
+    for (i = 0; i < N; i++) {
+        b = a[0];
+        b = a[L1_SIZE];
+    }
+
+    for (i = 0; i < N; i++) {
+        a[0] = b;
+        a[L1_SIZE] = b;
+    }
+
+    return 0;
+}